@@ -8,45 +8,760 @@
 /////[PREPROCESSOR]/////
 ////////////////////////
 
+/*
+ * Building with NO_ALLEGRO defined produces a headless-only binary
+ * that neither links nor initializes Allegro.
+ */
+#ifndef NO_ALLEGRO
 #include <allegro5/allegro5.h>
 #include <allegro5/allegro_font.h>
 #include <allegro5/allegro_primitives.h>
+#endif
 #include <argp.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <limits.h>
 #include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define DISPLAYX 750
 #define DISPLAYY 500
 
+// Both terminal states must fit in a compact cell
 #define CURED_STATE (-128)
-#define DEAD_STATE (-256)
+#define DEAD_STATE (-127)
+
+// Largest immunity for which cells are stored in a single byte
+#define COMPACT_MAX_INFECTED_VALUE INT8_MAX
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+// Side of the square tiles the sparse engine tracks activity in
+#define TILE_SIZE 64
+
+// Grids at least this big are backed by huge pages, see alloc_grid
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/*
+ * Ensemble statistics keep a histogram per step with values below 16
+ * in a bin each, and then 8 bins for each power of two up to 2^40.
+ */
+#define HISTOGRAM_EXACT 16
+#define HISTOGRAM_SUBBINS 8
+#define HISTOGRAM_BINS (HISTOGRAM_EXACT + HISTOGRAM_SUBBINS*37)
+
+#define CHECKPOINT_MAGIC "EPIDCKPT"
+#define CHECKPOINT_VERSION 1
+
+#define OUTPUT_MAGIC "EPIDTALY"
+#define OUTPUT_VERSION 1
+// Rows handed to the output thread at a time
+#define OUTPUT_BLOCK_ROWS 1024
+
+#define NETWORK_MAGIC "EPIDNETW"
+#define NETWORK_VERSION 1
+
+#define BENCH_MAX_DIMENSION 20000
+
+// Keeps the table of chances per number of infected neighbours small
+#define MAX_RADIUS 1000
+
+// Tallies recorded in the history of a run
+#define HISTORY_SERIES 4
+// Buckets kept at each resolution, at least as many as the graph is wide
+#define HISTORY_BUCKETS 512
+// Resolutions kept, enough for 2^48 steps
+#define HISTORY_LEVELS 40
+
+// Enough levels of detail for any grid that fits in memory
+#define VIEW_MAX_LEVELS 24
+// Zooming in stops at this many cells across
+#define VIEW_MIN_SPAN 8
+
+#ifdef PROFILE
+// Samples kept per thread, see struct profile_ring
+#define PROFILE_SAMPLES 4096
+// Samples the panel averages over
+#define PROFILE_WINDOW 64
+#endif
 
 
 ///////////////////////////
 /////[DATA STRUCTURES]/////
 ///////////////////////////
 
+/*
+ * Settings a parameter sweep can range over.
+ */
+enum sweep_field {
+        SWEEP_LETHALITY,
+        SWEEP_INFECTIOUSNESS,
+        SWEEP_IMMUNITY,
+        SWEEP_IMMUNIZATION,
+        SWEEP_DIMENSION,
+        SWEEP_FIELDS,
+};
+
+/*
+ * Values from start to stop, both included, every step.
+ */
+struct sweep_range {
+        bool set;
+        double start, stop, step;
+};
+
+/*
+ * Formats per-step tallies can be written in, see output_formats.
+ */
+enum output_format {
+        OUTPUT_CSV,
+        OUTPUT_BINARY,
+};
+
+enum engine {
+        // Visit every cell on every step
+        ENGINE_DENSE,
+        // Only visit tiles with infected cells in or next to them
+        ENGINE_SPARSE,
+        // Only visit infected cells and healthy ones next to them, found
+        // 64 at a time from bitplanes
+        ENGINE_BITBOARD,
+        // Only process transitions, scheduled by sampling how many steps
+        // away they are
+        ENGINE_EVENT,
+        ENGINES,
+};
+
+/*
+ * Which individuals count as next to each other.
+ */
+enum neighbourhood {
+        // The four sharing a side; any of them infected can pass it on
+        NEIGHBOURHOOD_VON_NEUMANN,
+        // All within a square of some radius; each infected one is a
+        // separate chance of passing it on
+        NEIGHBOURHOOD_MOORE,
+        NEIGHBOURHOODS,
+};
+
+#ifndef NO_ALLEGRO
+/*
+ * A colour as given on the command line.
+ */
+struct rgb {
+        unsigned char r, g, b;
+};
+#endif
+
 struct settings {
+#ifndef NO_ALLEGRO
+        // Colours as given, and as mapped once Allegro is initialized,
+        // see map_colors
+        struct rgb background_rgb, text_rgb, ui_rgb;
+        struct rgb healthy_rgb, cured_rgb, dead_rgb;
+        struct rgb infected_rgb_min, infected_rgb_max;
         ALLEGRO_COLOR background_color, text_color, ui_color;
         ALLEGRO_COLOR healthy_color, cured_color, dead_color;
         ALLEGRO_COLOR infected_color_min, infected_color_max;
         ALLEGRO_FONT *text_font;
+#endif
         int simulation_grid_dimension;
         int max_infected_value;
         double simulation_timestep, lethality, infectiousness;
         double immunization_chance;
-        int steplimit;
         bool step_at_a_time;
         int rng_seed;
+        bool headless;
+        int headless_steps;
+        int threads;
+        enum engine engine;
+        enum neighbourhood neighbourhood;
+        int radius;
+        bool use_simd;
+        int runs;
+        bool sweeping;
+        struct sweep_range sweep[SWEEP_FIELDS];
+        const char *checkpoint_path;
+        int checkpoint_every;
+        bool checkpoint_rle;
+        const char *resume_path;
+        const struct checkpoint *resume;
+        const char *output_path;
+        enum output_format output_format;
+        bool output_transitions;
+        int procs;
+        int bench_dimension;
+        const char *network_path;
+        long patient_zero;
+#ifdef PROFILE
+        const char *trace_path;
+#endif
+};
+
+/*
+ * A random number stream, see rng_draw.
+ */
+struct rng {
+        uint64_t key;
+};
+
+/*
+ * Probabilities as thresholds to compare random numbers against, see
+ * chance.
+ */
+struct chances {
+        uint64_t lethality, infectiousness, immunization;
+};
+
+/*
+ * Chances that can't go more than one way for a whole step, see
+ * kernel_for. Each combination gets its own copy of the step kernels,
+ * with the random draws and branches these make pointless left out.
+ */
+enum kernel {
+        // Nobody dies, so no lethality draw is made
+        KERNEL_NO_DEATHS = 1 << 0,
+        // Everyone infected for 'immunity' steps is cured without a draw
+        KERNEL_SURE_CURE = 1 << 1,
+        KERNELS = 1 << 2,
+};
+
+/*
+ * Vector instruction sets the compact step kernel can use.
+ */
+enum simd {
+        SIMD_NONE,
+        SIMD_SSE2,
+        SIMD_AVX2,
+};
+
+/*
+ * How many individuals are in each state.
+ */
+struct tally {
+        long healthy, infected, cured, dead;
+};
+
+/*
+ * State changes made during a step. They are all that is needed to
+ * keep a tally up to date without scanning the grid.
+ */
+struct transitions {
+        long infections, deaths, cures;
+};
+
+/*
+ * Statistics of all the runs of an ensemble at one step.
+ */
+struct ensemble_step {
+        long infected_sum, dead_sum;
+        uint32_t infected_bins[HISTOGRAM_BINS];
+        uint32_t dead_bins[HISTOGRAM_BINS];
+};
+
+/*
+ * Many runs of the same simulation with consecutive seeds, shared by a
+ * pool of workers that take runs one at a time. Each worker records
+ * the curve of its run and merges it into the per-step statistics
+ * once done, so no run's history is kept past its end.
+ */
+struct ensemble {
+        struct settings *settings;
+        int runs, steps;
+        int next_run;
+        struct ensemble_step *stats;
+        pthread_mutex_t lock;
+};
+
+/*
+ * Outcome of one run of a parameter sweep.
+ */
+struct sweep_result {
+        double values[SWEEP_FIELDS];
+        int seed;
+        struct tally final;
+        long peak_infected;
+        int peak_step, extinction_step;
+};
+
+/*
+ * Every combination of the swept settings times --runs seeds, shared by
+ * a pool of workers that take runs one at a time.
+ */
+struct sweep {
+        struct settings *settings;
+        int counts[SWEEP_FIELDS];
+        int seeds;
+        int jobs;
+        int next_job;
+        struct sweep_result *results;
+};
+
+enum checkpoint_encoding {
+        CHECKPOINT_RAW,
+        CHECKPOINT_RLE,
+};
+
+/*
+ * Start of a checkpoint file, in native byte order. The random numbers
+ * of a step only depend on the seed and the step number, so they are
+ * all the random state there is to save.
+ *
+ * It's followed by the dimension*dimension cells of the grid, row
+ * after row, either as they are in memory or as runs of a uint32_t
+ * count and an int32_t cell state.
+ */
+struct checkpoint_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t encoding;
+        uint32_t cell_size;
+        int32_t dimension;
+        int32_t max_infected_value;
+        int32_t rng_seed;
+        double lethality, infectiousness, immunization_chance;
+        uint64_t step;
+        uint64_t payload_size;
+};
+
+/*
+ * A checkpoint mapped into memory to resume from.
+ */
+struct checkpoint {
+        void *mapping;
+        size_t size;
+        const struct checkpoint_header *header;
+        const void *payload;
+};
+
+/*
+ * Checkpoints are written by a thread of their own from a copy of the
+ * grid. When one is due while the previous one is still being written,
+ * the simulation goes on and it's taken at the first step after that.
+ */
+struct checkpoint_writer {
+        const char *path;
+        int every;
+        bool rle;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+
+        struct checkpoint_header header;
+        void *cells;
+        bool busy, quit;
+        uint64_t next_step, written_step;
+};
+
+/*
+ * What is recorded of every step.
+ */
+struct output_row {
+        uint64_t step;
+        struct tally tally;
+        struct transitions transitions;
+};
+
+/*
+ * How to write rows in an output format.
+ */
+struct output_format_ops {
+        void (*write_header)(FILE *file, bool transitions);
+        void (*write_row)(FILE *file, const struct output_row *row, bool transitions);
+};
+
+/*
+ * Rows are gathered in a block, which is handed to a thread of its own
+ * to be written when full. The simulation only waits if the thread is
+ * still writing the previous block by then.
+ */
+struct output_sink {
+        const struct output_format_ops *ops;
+        FILE *file;
+        const char *path;
+        bool transitions;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+
+        struct output_row *filling, *writing;
+        int filled, pending;
+        bool quit;
+};
+
+/*
+ * Header of the binary form of a contact network, which is cached next
+ * to the edge list it was built from and followed by the offsets and
+ * neighbours of struct network. The size and modification time of the
+ * edge list tell whether the cache is still up to date.
+ */
+struct network_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodes;
+        uint64_t entries;
+        int64_t source_size;
+        int64_t source_seconds, source_nanoseconds;
+};
+
+/*
+ * A contact network in compressed sparse row form: the neighbours of
+ * node v are neighbours[offsets[v]] up to neighbours[offsets[v+1]].
+ * Every edge is stored both ways. The arrays are either mapped from
+ * the cache or built and owned.
+ */
+struct network {
+        uint32_t nodes;
+        uint64_t entries;
+        const uint64_t *offsets;
+        const uint32_t *neighbours;
+
+        void *mapping;
+        size_t mapping_size;
+        uint64_t *owned_offsets;
+        uint32_t *owned_neighbours;
+};
+
+/*
+ * A range of nodes stepped by one thread. Ranges are split so that
+ * each has about as many nodes plus edges to go through, as a few
+ * nodes can have most of the edges.
+ */
+struct network_band {
+        struct network_simulation *simulation;
+        uint32_t first_node, end_node;
+        struct transitions transitions;
+        pthread_t thread;
+};
+
+/*
+ * The simulation run over a contact network instead of a grid. Node
+ * states are stored like cells, see load_cell, one per node with no
+ * border, and random draws are keyed by node number, so a lattice
+ * given as a network with its cells numbered row by row steps exactly
+ * like the grid.
+ */
+struct network_simulation {
+        const struct network *network;
+        struct settings *settings;
+        bool compact;
+        void *state, *next_state;
+        uint64_t step;
+        struct tally tally;
+        struct transitions transitions;
+
+        struct rng rng;
+        struct chances chances;
+        int kernel;
+
+        int threads;
+        bool quit;
+        struct network_band *bands;
+        pthread_barrier_t step_start, step_done;
+};
+
+enum event_kind {
+        EVENT_INFECTION,
+        EVENT_DEATH,
+        EVENT_CURE,
 };
 
+/*
+ * A transition the event engine has scheduled for a cell. Infections
+ * only go ahead if the cell is still at the generation it was at when
+ * scheduled, see step_events. Deaths and cures keep the step the cell
+ * was infected at, which its age is worked out from.
+ */
+struct event {
+        uint64_t key;
+        size_t cell;
+        int64_t infected_step;
+        uint8_t kind;
+        uint8_t generation;
+};
+
+/*
+ * Shared between the processes that each step a strip of the grid, see
+ * run_processes. Every process publishes its first and last rows and
+ * its tally after each step, in one of two sets of slots depending on
+ * the parity of the step, so that publishing a step never overwrites
+ * what slower processes may still be reading of the one before.
+ */
+struct strip_exchange {
+        pthread_barrier_t barrier;
+        int procs;
+        size_t row_size;
+        // [parity][process]
+        struct tally *tallies;
+        struct transitions *transitions;
+        // [parity][process][first or last row]
+        char *rows;
+};
+
+struct simulation;
+
+/*
+ * A band of consecutive rows stepped by one thread. The sparse engine
+ * ignores the rows and has threads take tile rows one at a time.
+ */
+struct step_band {
+        struct simulation *simulation;
+        int first_row, end_row;
+        struct transitions transitions;
+        pthread_t thread;
+
+        // Infected individuals per column near the row being stepped,
+        // with a radius of zeroes on either side, see step_moore_rows
+        int *column_counts;
+};
+
+/*
+ * The simulation grids. Both are allocated once up front and swapped
+ * on every step, so that stepping never allocates. Cells are int8_t
+ * when compact is set and int otherwise, see load_cell and store_cell.
+ * Each grid is surrounded by a border of healthy cells that is never
+ * written, so neighbours can be read without bounds checks, see
+ * grid_index.
+ *
+ * With more than one thread the rows are split in bands, the first
+ * one stepped by the calling thread and each other one by a worker
+ * that waits on the step_start barrier.
+ *
+ * The sparse engine keeps, for each tile, whether it holds infected
+ * cells and whether its cells differ between both grids. Only tiles
+ * with infected cells in them or in a tile next to them can change.
+ *
+ * The tally of the current grid is kept up to date on every step from
+ * the transitions counted by each band.
+ *
+ * With a Moore neighbourhood, infection_chances holds the threshold to
+ * catch the infection from each number of infected neighbours, worked
+ * out for the infectiousness it was last stepped with.
+ */
+struct simulation {
+        int dimension;
+        bool compact;
+        enum engine engine;
+        enum simd simd;
+        void *state;
+        void *next_state;
+        uint64_t step;
+        struct tally tally;
+        struct transitions transitions;
+        struct rng rng;
+        struct chances chances;
+        int kernel;
+        struct settings *settings;
+
+        int radius;
+        uint64_t *infection_chances;
+        double chances_infectiousness;
+
+        int threads;
+        struct step_band *bands;
+        pthread_barrier_t step_start, step_done;
+        bool quit;
+
+        int tiles;
+        bool *tile_active;
+        bool *tile_next_active;
+        bool *tile_stale;
+        int next_tile_row;
+
+        // When not NULL, which tiles the last step left with an infected
+        // individual, see track_infected_tiles
+        bool *tile_infected;
+
+        int words;
+        uint64_t *infected;
+        uint64_t *next_infected;
+        uint64_t *healthy;
+
+        struct event *events;
+        size_t event_count, event_capacity;
+        uint8_t *generations;
+};
+
+/*
+ * Parts of the program that are timed when built with -DPROFILE, see
+ * profile_begin.
+ */
+enum profile_phase {
+        PROFILE_STEP,
+        PROFILE_TALLY,
+        PROFILE_CHECKPOINT,
+        PROFILE_OUTPUT,
+        PROFILE_SNAPSHOT,
+        PROFILE_RENDER,
+        PROFILE_GRAPH,
+        PROFILE_FRAME,
+        PROFILE_PHASES,
+};
+
+#ifdef PROFILE
+/*
+ * When a phase started and how long it took, in nanoseconds of the
+ * monotonic clock.
+ */
+struct profile_sample {
+        uint64_t start, duration;
+        enum profile_phase phase;
+};
+
+/*
+ * The latest samples timed on a thread. Only that thread writes to it,
+ * and it only bumps the count once a sample is complete, so other
+ * threads can read the samples before the count as long as they stay
+ * well clear of the oldest one, which is the next to be overwritten.
+ */
+struct profile_ring {
+        int id;
+        const char *name;
+        uint64_t count;
+        struct profile_sample samples[PROFILE_SAMPLES];
+};
+
+/*
+ * A Chrome trace file that samples are copied into from a ring before
+ * they are overwritten.
+ */
+struct profile_trace {
+        const char *path;
+        FILE *file;
+        uint64_t written;
+        bool first;
+};
+#endif
+
+#ifndef NO_ALLEGRO
+/*
+ * A copy of a generation of the simulation, as published for drawing.
+ */
+struct snapshot {
+        int dimension;
+        bool compact;
+        void *cells;
+        struct tally tally;
+        uint64_t step;
+
+        // For grids drawn through levels of detail, see struct
+        // grid_view: which tiles changed since the previous snapshot,
+        // and which since this one was taken, to copy in next time
+        int tiles;
+        bool *dirty;
+        bool *stale;
+};
+
+/*
+ * The tallies of 2^level steps, starting from step index << level.
+ */
+struct history_bucket {
+        uint64_t index;
+        long count;
+        long min[HISTORY_SERIES], max[HISTORY_SERIES];
+        double sum[HISTORY_SERIES];
+};
+
+/*
+ * The tallies of every step of a run, in bounded memory. Level l keeps
+ * the latest HISTORY_BUCKETS buckets of 2^l steps each in a ring, so
+ * however long the run, some level covers all of it in no more buckets
+ * than that.
+ */
+struct history {
+        uint64_t first_step, last_step;
+        bool empty;
+        struct history_bucket levels[HISTORY_LEVELS][HISTORY_BUCKETS];
+};
+
+/*
+ * Runs the simulation on its own thread and hands generations to the
+ * drawing thread through three snapshots. The simulation thread fills
+ * the back one and swaps it with the middle one, and the drawing
+ * thread swaps the middle one with the front one it draws from, both
+ * while holding the lock. A snapshot is only copied when the drawing
+ * thread has asked for a new one since the last time, so stepping
+ * faster than drawing doesn't copy grids that are never shown.
+ */
+struct simulation_thread {
+        struct simulation *simulation;
+        struct settings *settings;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+
+        struct snapshot snapshots[3];
+        int back, middle, front;
+        bool fresh, wanted;
+        // Which tiles were left with an infected individual by the
+        // step before last, when the snapshots are kept by tile
+        bool *last_infected_tiles;
+
+        struct history *history;
+
+        bool paused, quit;
+        int requested_steps;
+
+        struct checkpoint_writer *checkpoints;
+        struct output_sink *output;
+#ifdef PROFILE
+        struct profile_ring profile;
+#endif
+};
+
+/*
+ * The part of the grid being looked at, span cells across starting
+ * from x, y, and how to colour it. Colours are looked up by cell state
+ * as pixels ready to copy in, see color_index. When there are more
+ * cells across than pixels, every pixel is taken from a level of
+ * detail instead: level l holds the average colour of every 2^l by
+ * 2^l block of cells, and is kept up to date by only redoing the
+ * blocks in tiles that changed.
+ */
+struct grid_view {
+        uint32_t *colors;
+        int max_infected_value;
+
+        int dimension;
+        int x, y, span;
+
+        int levels;
+        int level_dimensions[VIEW_MAX_LEVELS + 1];
+        uint32_t *level_pixels[VIEW_MAX_LEVELS + 1];
+        bool built;
+};
+
+/*
+ * The view is drawn by writing it into a bitmap with at most one pixel
+ * per window pixel, which is then drawn scaled to the window.
+ */
+struct grid_renderer {
+        ALLEGRO_BITMAP *bitmap;
+        struct grid_view view;
+};
+#endif
+
 
 ///////////////////
 /////[GLOBALS]/////
@@ -56,6 +771,22 @@ struct settings {
 const char *argp_program_version = "epidemics 1.0";
 const char *argp_program_bug_address = "<mail@davidcarreracasado.cat>";
 
+#ifdef PROFILE
+// Where the calling thread records its samples, if anywhere
+static _Thread_local struct profile_ring *profile_ring = NULL;
+
+static const char *const profile_phase_names[PROFILE_PHASES] = {
+        [PROFILE_STEP] = "step",
+        [PROFILE_TALLY] = "tally",
+        [PROFILE_CHECKPOINT] = "checkpoint",
+        [PROFILE_OUTPUT] = "output",
+        [PROFILE_SNAPSHOT] = "snapshot",
+        [PROFILE_RENDER] = "render",
+        [PROFILE_GRAPH] = "graph",
+        [PROFILE_FRAME] = "frame",
+};
+#endif
+
 
 ////////////////////////////
 /////[ARGUMENT PARSING]/////
@@ -97,6 +828,7 @@ static int parse_int(char *str, bool allow_negative, struct argp_state *state) {
         return (int)ret;
 }
 
+#ifndef NO_ALLEGRO
 static unsigned char parse_rgb_component(char *str, char **next, struct argp_state *state, char *base) {
         errno = 0;
         long r = strtol(str, next, 0);
@@ -114,7 +846,7 @@ static unsigned char parse_rgb_component(char *str, char **next, struct argp_sta
         return (unsigned char)r;
 }
 
-static ALLEGRO_COLOR parse_rgb(char *str, struct argp_state *state) {
+static struct rgb parse_rgb(char *str, struct argp_state *state) {
         char *prev = str;
         char *next;
         
@@ -126,7 +858,112 @@ static ALLEGRO_COLOR parse_rgb(char *str, struct argp_state *state) {
         
         unsigned char b = parse_rgb_component(prev, &next, state, str);
 
-        return al_map_rgb(r, g, b);
+        return (struct rgb){r, g, b};
+}
+#endif
+
+static const char *const engine_names[ENGINES] = {
+        [ENGINE_DENSE] = "dense",
+        [ENGINE_SPARSE] = "sparse",
+        [ENGINE_BITBOARD] = "bitboard",
+        [ENGINE_EVENT] = "event",
+};
+
+static enum engine parse_engine(char *str, struct argp_state *state) {
+        for (int engine=0; engine<ENGINES; engine++) {
+                if (strcmp(str, engine_names[engine]) == 0) {
+                        return engine;
+                }
+        }
+
+        argp_error(state, "unknown engine: %s", str);
+        return ENGINE_DENSE;
+}
+
+static const char *const neighbourhood_names[NEIGHBOURHOODS] = {
+        [NEIGHBOURHOOD_VON_NEUMANN] = "von-neumann",
+        [NEIGHBOURHOOD_MOORE] = "moore",
+};
+
+static enum neighbourhood parse_neighbourhood(char *str, struct argp_state *state) {
+        for (int neighbourhood=0; neighbourhood<NEIGHBOURHOODS; neighbourhood++) {
+                if (strcmp(str, neighbourhood_names[neighbourhood]) == 0) {
+                        return neighbourhood;
+                }
+        }
+
+        argp_error(state, "unknown neighbourhood: %s", str);
+        return NEIGHBOURHOOD_VON_NEUMANN;
+}
+
+static enum output_format parse_output_format(char *str, struct argp_state *state) {
+        if (strcmp(str, "csv") == 0) {
+                return OUTPUT_CSV;
+        } else if (strcmp(str, "binary") == 0) {
+                return OUTPUT_BINARY;
+        }
+
+        argp_error(state, "unknown output format: %s", str);
+        return OUTPUT_CSV;
+}
+
+static const char *const sweep_field_names[SWEEP_FIELDS] = {
+        [SWEEP_LETHALITY] = "lethality",
+        [SWEEP_INFECTIOUSNESS] = "infectiousness",
+        [SWEEP_IMMUNITY] = "immunity",
+        [SWEEP_IMMUNIZATION] = "immunization",
+        [SWEEP_DIMENSION] = "dimension",
+};
+
+/*
+ * Parse a sweep as name=start:stop:step.
+ */
+static void parse_sweep(char *str, struct settings *settings, struct argp_state *state) {
+        char *values = strchr(str, '=');
+        if (values == NULL) {
+                argp_error(state, "expected name=start:stop:step: %s", str);
+                return;
+        }
+
+        int field;
+        for (field=0; field<SWEEP_FIELDS; field++) {
+                size_t length = strlen(sweep_field_names[field]);
+                if ((size_t)(values - str) == length && strncmp(str, sweep_field_names[field], length) == 0) {
+                        break;
+                }
+        }
+        if (field == SWEEP_FIELDS) {
+                argp_error(state, "unknown sweep setting: %s", str);
+                return;
+        }
+
+        // Each of start, stop and step must be there, in full
+        struct sweep_range *range = &settings->sweep[field];
+        double bounds[3];
+        char *next = values;
+        bool parsed = true;
+        for (int i=0; i<3 && parsed; i++) {
+                char *number = next+1;
+                bounds[i] = strtod(number, &next);
+                parsed = next != number && isfinite(bounds[i]) && *next == (i < 2 ? ':' : '\0');
+        }
+        double start = bounds[0], stop = bounds[1], step = bounds[2];
+        if (!parsed) {
+                argp_error(state, "failed to parse as start:stop:step: %s", str);
+                return;
+        } else if (!(step > 0) || stop < start) {
+                argp_error(state, "empty sweep range: %s", str);
+                return;
+        } else if ((field == SWEEP_IMMUNITY || field == SWEEP_DIMENSION) && start < 1) {
+                argp_error(state, "%s must be at least 1: %s", sweep_field_names[field], str);
+                return;
+        }
+
+        range->start = start;
+        range->stop = stop;
+        range->step = step;
+        range->set = true;
+        settings->sweeping = true;
 }
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -144,6 +981,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 break;
         case 'm':
                 settings->max_infected_value = parse_int(arg, false, state);
+                if (settings->max_infected_value == 0) {
+                        argp_error(state, "immunity must be at least 1: %s", arg);
+                }
                 break;
         case 'c':
                 settings->immunization_chance = parse_double(arg, state);
@@ -155,40 +995,169 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 settings->simulation_timestep = parse_double(arg, state);
                 break;
         case 'p':
-                settings->steplimit = parse_int(arg, false, state);
+                // The graph keeps the whole run now, this is only checked
+                parse_int(arg, false, state);
                 break;
         case 'r':
                 settings->rng_seed = parse_int(arg, true, state);
                 break;
-        case 40001:
-                settings->healthy_color = parse_rgb(arg, state);
+        case 30001:
+                settings->headless = true;
                 break;
-        case 40002:
-                settings->cured_color = parse_rgb(arg, state);
+        case 30002:
+                settings->headless_steps = parse_int(arg, false, state);
                 break;
-        case 40003:
-                settings->dead_color = parse_rgb(arg, state);
+        case 30003:
+                settings->threads = parse_int(arg, false, state);
                 break;
-        case 40004:
-                settings->infected_color_max = parse_rgb(arg, state);
+        case 30004:
+                settings->engine = parse_engine(arg, state);
                 break;
-        case 40005:
-                settings->infected_color_min = parse_rgb(arg, state);
+        case 30005:
+                settings->use_simd = false;
                 break;
-        case 50001:
-                settings->background_color = parse_rgb(arg, state);
+        case 30006:
+                settings->runs = parse_int(arg, false, state);
                 break;
-        case 50002:
-                settings->text_color = parse_rgb(arg, state);
+        case 30007:
+                parse_sweep(arg, settings, state);
                 break;
-        case 50003:
-                settings->ui_color = parse_rgb(arg, state);
+        case 30008:
+                settings->checkpoint_path = arg;
                 break;
-        default:
-                return ARGP_ERR_UNKNOWN;
-        }
-
-        return 0;
+        case 30009:
+                settings->checkpoint_every = parse_int(arg, false, state);
+                break;
+        case 30010:
+                settings->checkpoint_rle = true;
+                break;
+        case 30011:
+                settings->resume_path = arg;
+                break;
+        case 30012:
+                settings->output_path = arg;
+                break;
+        case 30013:
+                settings->output_format = parse_output_format(arg, state);
+                break;
+        case 30014:
+                settings->output_transitions = true;
+                break;
+        case 30015:
+                settings->procs = parse_int(arg, false, state);
+                break;
+        case 30016:
+                settings->bench_dimension = arg == NULL ? BENCH_MAX_DIMENSION : parse_int(arg, false, state);
+                break;
+        case 30018:
+                settings->network_path = arg;
+                break;
+        case 30019:
+                settings->patient_zero = parse_int(arg, false, state);
+                break;
+        case 30020:
+                settings->neighbourhood = parse_neighbourhood(arg, state);
+                break;
+        case 30021:
+                settings->radius = parse_int(arg, false, state);
+                if (settings->radius == 0 || settings->radius > MAX_RADIUS) {
+                        argp_error(state, "radius must be from 1 to %d: %s", MAX_RADIUS, arg);
+                }
+                break;
+#ifdef PROFILE
+        case 30017:
+                settings->trace_path = arg;
+                break;
+#endif
+        case ARGP_KEY_END:
+                if (settings->runs > 0 && !settings->sweeping && settings->headless_steps == 0) {
+                        argp_error(state, "running an ensemble requires --steps");
+                }
+                if ((settings->runs > 0 || settings->sweeping) &&
+                    (settings->checkpoint_path != NULL || settings->resume_path != NULL)) {
+                        argp_error(state, "checkpoints can't be used with --runs or --sweep");
+                }
+                if (settings->checkpoint_path == NULL &&
+                    (settings->checkpoint_every > 0 || settings->checkpoint_rle)) {
+                        argp_error(state, "checkpoint options require --checkpoint");
+                }
+                if ((settings->runs > 0 || settings->sweeping) && settings->output_path != NULL) {
+                        argp_error(state, "--output can't be used with --runs or --sweep");
+                }
+                if (settings->procs > 1) {
+                        if (settings->runs > 0 || settings->sweeping ||
+                            settings->checkpoint_path != NULL || settings->resume_path != NULL) {
+                                argp_error(state, "--procs can't be used with --runs, --sweep or checkpoints");
+                        }
+                        if (settings->engine != ENGINE_DENSE) {
+                                argp_error(state, "--procs only works with the dense engine");
+                        }
+                }
+                if (settings->network_path != NULL &&
+                    (settings->runs > 0 || settings->sweeping || settings->procs > 1 ||
+                     settings->checkpoint_path != NULL || settings->resume_path != NULL)) {
+                        argp_error(state, "--network can't be used with --runs, --sweep, --procs or checkpoints");
+                }
+                if (settings->bench_dimension > 0 &&
+                    (settings->runs > 0 || settings->sweeping || settings->procs > 1 ||
+                     settings->network_path != NULL ||
+                     settings->checkpoint_path != NULL || settings->resume_path != NULL)) {
+                        argp_error(state, "--bench can't be used with --runs, --sweep, --procs, --network "
+                                   "or checkpoints");
+                }
+                if (settings->network_path == NULL && settings->patient_zero >= 0) {
+                        argp_error(state, "--patient-zero requires --network");
+                }
+                if (settings->neighbourhood == NEIGHBOURHOOD_VON_NEUMANN && settings->radius != 1) {
+                        argp_error(state, "--radius requires --neighbourhood moore");
+                }
+                if (settings->neighbourhood == NEIGHBOURHOOD_MOORE &&
+                    (settings->engine != ENGINE_DENSE || settings->procs > 1 ||
+                     settings->bench_dimension > 0 || settings->network_path != NULL ||
+                     settings->checkpoint_path != NULL || settings->resume_path != NULL)) {
+                        argp_error(state, "--neighbourhood moore only works with the dense engine, "
+                                   "and not with --procs, --bench, --network or checkpoints");
+                }
+#ifdef PROFILE
+                if (settings->trace_path != NULL &&
+                    (!settings->headless || settings->runs > 0 || settings->sweeping ||
+                     settings->procs > 1 || settings->bench_dimension > 0 ||
+                     settings->network_path != NULL)) {
+                        argp_error(state, "--trace only works for a single --headless run");
+                }
+#endif
+                break;
+#ifndef NO_ALLEGRO
+        case 40001:
+                settings->healthy_rgb = parse_rgb(arg, state);
+                break;
+        case 40002:
+                settings->cured_rgb = parse_rgb(arg, state);
+                break;
+        case 40003:
+                settings->dead_rgb = parse_rgb(arg, state);
+                break;
+        case 40004:
+                settings->infected_rgb_max = parse_rgb(arg, state);
+                break;
+        case 40005:
+                settings->infected_rgb_min = parse_rgb(arg, state);
+                break;
+        case 50001:
+                settings->background_rgb = parse_rgb(arg, state);
+                break;
+        case 50002:
+                settings->text_rgb = parse_rgb(arg, state);
+                break;
+        case 50003:
+                settings->ui_rgb = parse_rgb(arg, state);
+                break;
+#endif
+        default:
+                return ARGP_ERR_UNKNOWN;
+        }
+
+        return 0;
 }
 
 static void parse_args(int argc, char *argv[], struct settings *settings) {
@@ -226,8 +1195,9 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
                         .key='m',
                         .arg="value",
                         .flags=0,
-                        .doc="After this many steps, an infected individual can be cured. Defaults "
-                        "to 10",
+                        .doc="After this many steps, an infected individual can be cured. Values "
+                        "up to 127 store each individual in a single byte instead of an int. "
+                        "Defaults to 10",
                         .group=2,
                 },
                 {
@@ -254,8 +1224,8 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
                         .key='t',
                         .arg="value",
                         .flags=0,
-                        .doc="Seconds between simulation steps. Ignored in manual step "
-                        "mode. Defaults to 0.1",
+                        .doc="Seconds between simulation steps, or 0 to step as fast as "
+                        "possible. Ignored in manual step mode. Defaults to 0.1",
                         .group=3,
                 },
                 {
@@ -263,9 +1233,8 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
                         .key='p',
                         .arg="value",
                         .flags=0,
-                        .doc="Total history of steps kept by graphic. After this many steps have "
-                        "passed, the plot stops scrolling. Default is 4096 and it's more than "
-                        "enough.",
+                        .doc="Ignored, kept so existing command lines still work. The graph "
+                        "now shows the whole run, however long.",
                         .group=3,
                 },
                 {
@@ -273,10 +1242,243 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
                         .key='r',
                         .arg="value",
                         .flags=0,
-                        .doc="Seed to use for the RNG (srand). Default is to use the value of "
-                        "time(NULL).",
+                        .doc="Seed to use for the RNG. Runs with the same seed give the same "
+                        "results regardless of the number of threads. Default is to use the "
+                        "value of time(NULL).",
+                        .group=3,
+                },
+                {
+                        .name="headless",
+                        .key=30001,
+                        .arg=NULL,
+                        .flags=0,
+                        .doc="Run the simulation as fast as possible without opening a window, "
+                        "printing the healthy, infected, cured and dead tallies of every step "
+                        "to stdout. Always enabled when built without Allegro.",
+                        .group=3,
+                },
+                {
+                        .name="steps",
+                        .key=30002,
+                        .arg="value",
+                        .flags=0,
+                        .doc="Maximum number of steps to simulate in headless mode. The "
+                        "simulation also stops once there are no infected individuals left. "
+                        "Default is 0, meaning no limit.",
+                        .group=3,
+                },
+                {
+                        .name="threads",
+                        .key=30003,
+                        .arg="value",
+                        .flags=0,
+                        .doc="Number of threads to run each simulation step on, each one "
+                        "taking a band of rows of the grid. When running an ensemble, the "
+                        "number of simulations run at once instead. Default is 1.",
+                        .group=3,
+                },
+                {
+                        .name="engine",
+                        .key=30004,
+                        .arg="name",
+                        .flags=0,
+                        .doc="How to step the simulation. 'dense' visits every individual on "
+                        "every step. 'sparse' only visits the areas of the grid with infected "
+                        "individuals in or next to them, giving the same results much faster "
+                        "when most of the grid is settled. 'bitboard' keeps which individuals "
+                        "are infected and healthy as bits, finds the healthy ones next to an "
+                        "infected one 64 at a time and only visits those and the infected, "
+                        "also with the same results. 'event' samples when every infection, "
+                        "death and cure will happen and only processes those, for work "
+                        "proportional to the number of transitions. Its results follow the "
+                        "same distribution but differ run by run from the other engines, "
+                        "and it always runs on one thread. Default is dense.",
+                        .group=3,
+                },
+                {
+                        .name="no-simd",
+                        .key=30005,
+                        .arg=NULL,
+                        .flags=0,
+                        .doc="Don't use SSE2 or AVX2 instructions to step the simulation, even if "
+                        "the CPU supports them. Results are the same either way.",
+                        .group=3,
+                },
+                {
+                        .name="runs",
+                        .key=30006,
+                        .arg="value",
+                        .flags=0,
+                        .doc="Run an ensemble of this many simulations for --steps steps, with "
+                        "seeds counting up from --seed, and print the mean and the 5th, 50th "
+                        "and 95th percentiles of infected and dead individuals at every step "
+                        "instead. Percentiles are exact up to 15 and within 1/16 above that. "
+                        "Implies --headless. Default is 0, meaning a single simulation.",
+                        .group=3,
+                },
+                {
+                        .name="sweep",
+                        .key=30007,
+                        .arg="name=start:stop:step",
+                        .flags=0,
+                        .doc="Sweep a setting over a range of values, where name is one of "
+                        "lethality, infectiousness, immunity, immunization or dimension. Can be "
+                        "given once for each of them to sweep over every combination, with "
+                        "--runs seeds each, on --threads threads. Prints one line per run "
+                        "with the final tally, the peak of infected individuals, its step and "
+                        "the step with no infected individuals left, or -1 if not reached "
+                        "within --steps. Implies --headless.",
+                        .group=3,
+                },
+                {
+                        .name="checkpoint",
+                        .key=30008,
+                        .arg="file",
+                        .flags=0,
+                        .doc="Save the simulation to this file when it ends, and every "
+                        "--checkpoint-every steps. Each checkpoint replaces the previous one "
+                        "once it's completely written.",
+                        .group=3,
+                },
+                {
+                        .name="checkpoint-every",
+                        .key=30009,
+                        .arg="steps",
+                        .flags=0,
+                        .doc="Save a checkpoint every this many steps. Default is 0, meaning only "
+                        "when the simulation ends.",
+                        .group=3,
+                },
+                {
+                        .name="checkpoint-rle",
+                        .key=30010,
+                        .arg=NULL,
+                        .flags=0,
+                        .doc="Run-length encode the grid in checkpoints.",
+                        .group=3,
+                },
+                {
+                        .name="resume",
+                        .key=30011,
+                        .arg="file",
+                        .flags=0,
+                        .doc="Continue the simulation saved in this checkpoint, with the grid "
+                        "dimension, immunity, chances and seed it was started with. Results "
+                        "are the same as if it had never stopped.",
+                        .group=3,
+                },
+                {
+                        .name="output",
+                        .key=30012,
+                        .arg="file",
+                        .flags=0,
+                        .doc="Write the tally of every step to this file.",
+                        .group=3,
+                },
+                {
+                        .name="output-format",
+                        .key=30013,
+                        .arg="format",
+                        .flags=0,
+                        .doc="Format of --output, either csv, or binary for a 16 byte header of "
+                        "\"EPIDTALY\", a uint32_t version and a uint32_t column count followed "
+                        "by rows of int64_t columns in native byte order. Default is csv.",
+                        .group=3,
+                },
+                {
+                        .name="output-transitions",
+                        .key=30014,
+                        .arg=NULL,
+                        .flags=0,
+                        .doc="Also write the infections, deaths and cures of every step to "
+                        "--output.",
+                        .group=3,
+                },
+                {
+                        .name="procs",
+                        .key=30015,
+                        .arg="n",
+                        .flags=0,
+                        .doc="Split the grid into this many strips of rows, each stepped by a "
+                        "process of its own with --threads threads, which only hold their own "
+                        "strip in memory and exchange the rows along its edges through shared "
+                        "memory. Results are the same for any number of processes. Only for "
+                        "the dense engine. Implies --headless. Default is 1.",
+                        .group=3,
+                },
+                {
+                        .name="bench",
+                        .key=30016,
+                        .arg="max-dimension",
+                        .flags=OPTION_ARG_OPTIONAL,
+                        .doc="Time stepping, tallying and, when built with Allegro, drawing, "
+                        "for every engine on grids from 100x100 up to 20000x20000 or the given "
+                        "dimension, starting with several shares of infected individuals. "
+                        "Steps are timed over --steps steps, 10 by default. Prints one line "
+                        "per measurement with the cells processed per second, nanoseconds "
+                        "per cell and peak resident memory. Implies --headless.",
+                        .group=3,
+                },
+                {
+                        .name="neighbourhood",
+                        .key=30020,
+                        .arg="name",
+                        .flags=0,
+                        .doc="Who can pass the infection on to whom. 'von-neumann' is the "
+                        "four individuals sharing a side, any of which being infected gives "
+                        "the infectiousness as the chance of catching it. 'moore' is everyone "
+                        "in the square of --radius around, and each infected one among them "
+                        "is a separate chance, so with k of them it's 1-(1-infectiousness)^k. "
+                        "Moore neighbourhoods take about the same time per step whatever the "
+                        "radius, but only work with the dense engine. Default is von-neumann.",
+                        .group=3,
+                },
+                {
+                        .name="radius",
+                        .key=30021,
+                        .arg="cells",
+                        .flags=0,
+                        .doc="How far a Moore neighbourhood reaches in each direction. "
+                        "Default is 1, the eight individuals around.",
+                        .group=3,
+                },
+                {
+                        .name="network",
+                        .key=30018,
+                        .arg="file",
+                        .flags=0,
+                        .doc="Run over a contact network instead of a grid. The file lists an "
+                        "edge per line as two node numbers from 0, separated by spaces, tabs "
+                        "or a comma, with lines starting with # or % ignored. It is read once "
+                        "into a binary form cached next to it as file.csr, which later runs "
+                        "load instead while the file is unchanged. Healthy individuals can "
+                        "catch the infection from any infected neighbour. Prints the same "
+                        "tallies as --headless and implies it.",
+                        .group=3,
+                },
+                {
+                        .name="patient-zero",
+                        .key=30019,
+                        .arg="node",
+                        .flags=0,
+                        .doc="Node of the --network that starts out infected. Defaults to the "
+                        "middle one by number.",
+                        .group=3,
+                },
+#ifdef PROFILE
+                {
+                        .name="trace",
+                        .key=30017,
+                        .arg="file",
+                        .flags=0,
+                        .doc="Write how long every step, checkpoint and output flush took "
+                        "to this file in Chrome trace format, which chrome://tracing and "
+                        "Perfetto can open. Only for --headless runs.",
                         .group=3,
                 },
+#endif
+
+#ifndef NO_ALLEGRO
 
                 {
                         .name="color-healthy",
@@ -351,13 +1553,16 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
                         .doc="Color to use for the ui elements. Default is 255,255,255",
                         .group=5,
                 },
+#endif
                 
                 {0},
         };
         static char doc[] = "A simple simulation of an epidemic with pretty colors and "
                 "graphics.\vPressing ESC exits the simulation as well as just closing "
                 "the window. Space can either advance a step in the simulation or "
-                "pause/unpause it, depending on whether manual step is enabled. For "
+                "pause/unpause it, depending on whether manual step is enabled. Plus "
+                "and minus zoom in and out, the arrow keys move around and Home shows "
+                "the whole grid again. For "
                 "options taking integers as arguments, these are parsed correctly as "
                 "hexadecimal if starting with 0x, octal if otherwise starting with 0 "
                 "and decimal in any other case. The same holds for rgb components.";
@@ -381,24 +1586,207 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
         settings->simulation_grid_dimension = 100;
         
         settings->simulation_timestep = 0.1;
-        settings->steplimit = 1<<12;
         settings->rng_seed = time(NULL);
+        settings->headless = false;
+        settings->headless_steps = 0;
+        settings->threads = 1;
+        settings->engine = ENGINE_DENSE;
+        settings->neighbourhood = NEIGHBOURHOOD_VON_NEUMANN;
+        settings->radius = 1;
+        settings->use_simd = true;
+        settings->runs = 0;
+        settings->sweeping = false;
+        for (int i=0; i<SWEEP_FIELDS; i++) {
+                settings->sweep[i].set = false;
+        }
+        settings->checkpoint_path = NULL;
+        settings->checkpoint_every = 0;
+        settings->checkpoint_rle = false;
+        settings->resume_path = NULL;
+        settings->resume = NULL;
+        settings->output_path = NULL;
+        settings->output_format = OUTPUT_CSV;
+        settings->output_transitions = false;
+        settings->procs = 1;
+        settings->bench_dimension = 0;
+        settings->network_path = NULL;
+        settings->patient_zero = -1;
+#ifdef PROFILE
+        settings->trace_path = NULL;
+#endif
         
-        settings->healthy_color = al_map_rgb(0x00, 0xFF, 0x00);
-        settings->cured_color = al_map_rgb(0xFF, 0xFF, 0x00);
-        settings->dead_color = al_map_rgb(0xFF, 0x00, 0xFF);
-        settings->infected_color_min = al_map_rgb(0x80, 0x00, 0x00);
-        settings->infected_color_max = al_map_rgb(0xFF, 0x00, 0x00);
+#ifndef NO_ALLEGRO
+        settings->healthy_rgb = (struct rgb){0x00, 0xFF, 0x00};
+        settings->cured_rgb = (struct rgb){0xFF, 0xFF, 0x00};
+        settings->dead_rgb = (struct rgb){0xFF, 0x00, 0xFF};
+        settings->infected_rgb_min = (struct rgb){0x80, 0x00, 0x00};
+        settings->infected_rgb_max = (struct rgb){0xFF, 0x00, 0x00};
         
-        settings->background_color = al_map_rgb(0x00, 0x00, 0x00);
-        settings->text_color = al_map_rgb(0xff, 0xff, 0xff);
-        settings->ui_color = al_map_rgb(0xff, 0xff, 0xff);
+        settings->background_rgb = (struct rgb){0x00, 0x00, 0x00};
+        settings->text_rgb = (struct rgb){0xff, 0xff, 0xff};
+        settings->ui_rgb = (struct rgb){0xff, 0xff, 0xff};
+#else
+        settings->headless = true;
+#endif
 
         // Now load from arguments
         argp_parse(&arg, argc, argv, 0, NULL, settings);
 }
 
 
+/////////////////////////////
+/////[PROFILE FUNCTIONS]/////
+/////////////////////////////
+
+#ifdef PROFILE
+static uint64_t profile_now(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void init_profile_ring(struct profile_ring *ring, int id, const char *name) {
+        ring->id = id;
+        ring->name = name;
+        ring->count = 0;
+}
+
+/*
+ * Record the phases timed on the calling thread in a ring from now on.
+ */
+static void start_profile_ring(struct profile_ring *ring) {
+        profile_ring = ring;
+}
+
+static void stop_profile_ring(void) {
+        profile_ring = NULL;
+}
+#endif
+
+/*
+ * Time a phase from profile_begin to profile_end, if the calling
+ * thread has a ring to record it in. Without -DPROFILE both are empty
+ * and compile away entirely.
+ */
+static ALWAYS_INLINE uint64_t profile_begin(void) {
+#ifdef PROFILE
+        if (profile_ring != NULL) {
+                return profile_now();
+        }
+#endif
+        return 0;
+}
+
+static ALWAYS_INLINE void profile_end(enum profile_phase phase, uint64_t start) {
+#ifdef PROFILE
+        struct profile_ring *ring = profile_ring;
+        if (ring == NULL) {
+                return;
+        }
+
+        struct profile_sample *sample = &ring->samples[ring->count % PROFILE_SAMPLES];
+        sample->start = start;
+        sample->duration = profile_now() - start;
+        sample->phase = phase;
+        __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+#else
+        (void)phase;
+        (void)start;
+#endif
+}
+
+#ifdef PROFILE
+#ifndef NO_ALLEGRO
+/*
+ * The mean duration in milliseconds of the latest samples of a phase
+ * in a ring, and how many times a second the phase has run over them
+ * up to now, which falls towards 0 while it doesn't run.
+ */
+static void profile_stats(const struct profile_ring *ring, enum profile_phase phase,
+                          double *milliseconds, double *rate) {
+        uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        uint64_t first = count - MIN(count, PROFILE_SAMPLES / 2);
+        uint64_t total = 0, oldest = 0;
+        int found = 0;
+        for (uint64_t i=count; i>first && found<PROFILE_WINDOW; i--) {
+                const struct profile_sample *sample = &ring->samples[(i-1) % PROFILE_SAMPLES];
+                if (sample->phase == phase) {
+                        total += sample->duration;
+                        oldest = sample->start;
+                        found++;
+                }
+        }
+
+        uint64_t now = profile_now();
+        *milliseconds = found > 0 ? total / 1e6 / found : 0;
+        *rate = found > 0 && now > oldest ? found * 1e9 / (now - oldest) : 0;
+}
+#endif
+
+static void start_trace(const struct settings *settings, struct profile_trace *trace) {
+        trace->path = settings->trace_path;
+        trace->file = NULL;
+        if (trace->path == NULL) {
+                return;
+        }
+
+        trace->file = fopen(trace->path, "w");
+        if (trace->file == NULL) {
+                fprintf(stderr, "couldn't open trace %s: %s\n", trace->path, strerror(errno));
+                exit(1);
+        }
+        trace->written = 0;
+        trace->first = true;
+        fprintf(trace->file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+}
+
+/*
+ * Copy the samples of a ring that aren't in the trace yet into it, if
+ * the ring is half full of them or when finishing. Must be called
+ * often enough that the ring doesn't go all the way around in between.
+ */
+static void drain_trace(struct profile_trace *trace, const struct profile_ring *ring, bool finish) {
+        if (trace->file == NULL || (!finish && ring->count - trace->written < PROFILE_SAMPLES / 2)) {
+                return;
+        }
+
+        if (trace->first) {
+                fprintf(trace->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"name\":\"%s\"}}", (int)getpid(), ring->id, ring->name);
+                trace->first = false;
+        }
+
+        for (uint64_t i=MAX(trace->written, ring->count - MIN(ring->count, PROFILE_SAMPLES)); i<ring->count; i++) {
+                const struct profile_sample *sample = &ring->samples[i % PROFILE_SAMPLES];
+                fprintf(trace->file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d}", profile_phase_names[sample->phase],
+                        sample->start / 1e3, sample->duration / 1e3, (int)getpid(), ring->id);
+        }
+        trace->written = ring->count;
+}
+
+/*
+ * Write out the remaining samples and close the file. Returns false if
+ * anything failed to be written.
+ */
+static bool stop_trace(struct profile_trace *trace, const struct profile_ring *ring) {
+        if (trace->file == NULL) {
+                return true;
+        }
+
+        drain_trace(trace, ring, true);
+        fprintf(trace->file, "\n]}\n");
+
+        bool ok = !ferror(trace->file);
+        ok = fclose(trace->file) == 0 && ok;
+        if (!ok) {
+                fprintf(stderr, "couldn't write trace %s\n", trace->path);
+        }
+        return ok;
+}
+#endif
+
+
 /////////////////////////////
 /////[UTILITY FUNCTIONS]/////
 /////////////////////////////
@@ -412,96 +1800,3464 @@ static void must_init(bool test, const char *description) {
         exit(1);
 }
 
-static void tally_state(const int *state, int dim, int *healthy, int *infected, int *cured, int *dead) {
-        *healthy = *infected = *cured = *dead = 0;
+/*
+ * Allocate zeroed memory for a grid. Big grids are mapped directly and
+ * backed by huge pages where the kernel allows it, as stepping sweeps
+ * over all of them and would otherwise miss the TLB on every few rows.
+ */
+static void *alloc_grid(size_t size) {
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE) {
+                void *grid = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (grid == MAP_FAILED) {
+                        return NULL;
+                }
+                madvise(grid, size, MADV_HUGEPAGE);
+                return grid;
+        }
+#endif
+        return calloc(1, size);
+}
+
+static void free_grid(void *grid, size_t size) {
+#ifdef MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE) {
+                if (grid != NULL) {
+                        munmap(grid, size);
+                }
+                return;
+        }
+#endif
+        free(grid);
+}
+
+/*
+ * Cell accessors for either grid encoding. They are always inlined so
+ * that callers passing a constant compact flag get a loop specialized
+ * for that cell type.
+ */
+static ALWAYS_INLINE int load_cell(const void *grid, size_t index, bool compact) {
+        if (compact) {
+                return ((const int8_t *)grid)[index];
+        } else {
+                return ((const int *)grid)[index];
+        }
+}
+
+static ALWAYS_INLINE void store_cell(void *grid, size_t index, int value, bool compact) {
+        if (compact) {
+                ((int8_t *)grid)[index] = (int8_t)value;
+        } else {
+                ((int *)grid)[index] = value;
+        }
+}
+
+/*
+ * Index of the cell at row x, column y, of a grid with its border.
+ * Rows and columns -1 and dim are the border.
+ */
+static ALWAYS_INLINE size_t grid_index(int dim, int x, int y) {
+        return (size_t)(y + 1) + (size_t)(x + 1) * ((size_t)dim + 2);
+}
+
+static size_t grid_cells(int dim) {
+        return ((size_t)dim + 2) * ((size_t)dim + 2);
+}
+
+/*
+ * Bitplanes hold a bit per cell, with bit j%64 of word j/64 of a row
+ * for column j. Like grids, they have a border a row and a word wide
+ * that is never set, and neither are the bits past the last column.
+ */
+static ALWAYS_INLINE size_t plane_index(int words, int x, int word) {
+        return ((size_t)word + 1) + ((size_t)x + 1) * ((size_t)words + 2);
+}
+
+static size_t plane_words(int dim, int words) {
+        return ((size_t)dim + 2) * ((size_t)words + 2);
+}
+
+static ALWAYS_INLINE bool isinfected(const void *state, int x, int y, int size, bool compact) {
+        return load_cell(state, grid_index(size, x, y), compact) > 0;
+}
+
+static ALWAYS_INLINE void tally_grid(const void *state, int dim, int first_row, int end_row,
+                                     bool compact, struct tally *tally) {
+        tally->healthy = tally->infected = tally->cured = tally->dead = 0;
         
-        for (int i=0; i<dim; i++) {
+        for (int i=first_row; i<end_row; i++) {
                 for (int j=0; j<dim; j++) {
-                        int s = state[j+i*dim];
+                        int s = load_cell(state, grid_index(dim, i, j), compact);
                         if (s == CURED_STATE) {
-                                (*cured)++;
+                                tally->cured++;
                         } else if (s == DEAD_STATE) {
-                                (*dead)++;
+                                tally->dead++;
                         } else if (s == 0) {
-                                (*healthy)++;
+                                tally->healthy++;
                         } else {
-                                (*infected)++;
+                                tally->infected++;
                         }
                 }
         }
 }
 
+static void tally_rows(const struct simulation *simulation, int first_row, int end_row,
+                       struct tally *tally) {
+        if (simulation->compact) {
+                tally_grid(simulation->state, simulation->dimension, first_row, end_row, true, tally);
+        } else {
+                tally_grid(simulation->state, simulation->dimension, first_row, end_row, false, tally);
+        }
+}
+
+/*
+ * Count the individuals in each state by scanning the whole grid.
+ * Stepping keeps simulation->tally up to date, so this is only needed
+ * when the grid is set up.
+ */
+static void tally_state(const struct simulation *simulation, struct tally *tally) {
+        uint64_t start = profile_begin();
+        tally_rows(simulation, 0, simulation->dimension, tally);
+        profile_end(PROFILE_TALLY, start);
+}
+
+static void apply_transitions(struct tally *tally, const struct transitions *transitions) {
+        tally->healthy -= transitions->infections;
+        tally->infected += transitions->infections - transitions->deaths - transitions->cures;
+        tally->dead += transitions->deaths;
+        tally->cured += transitions->cures;
+}
+
+/*
+ * Random numbers are counter based, in the style of Philox: each one
+ * is a SplitMix64 hash of a per-step key, the cell and which of the
+ * cell's draws it is. This makes runs reproducible, on any platform,
+ * no matter how many threads share the grid or in which order its
+ * cells are visited.
+ */
+#define GOLDEN_GAMMA UINT64_C(0x9E3779B97F4A7C15)
+
+// Bits of each random number used by chance
+#define CHANCE_BITS 53
+
+static ALWAYS_INLINE uint64_t mix64(uint64_t z) {
+        z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+        return z ^ (z >> 31);
+}
+
+/*
+ * The seed of a run numbered from a first seed, wrapping around past
+ * INT_MAX rather than overflowing. Random draws only use its bits.
+ */
+static int offset_seed(int seed, int offset) {
+        return (int)((unsigned)seed + (unsigned)offset);
+}
+
+static struct rng rng_for_step(int seed, uint64_t step) {
+        struct rng rng = {
+                .key = mix64((uint64_t)(unsigned)seed * GOLDEN_GAMMA ^ mix64(step + 1)),
+        };
+        return rng;
+}
+
+static ALWAYS_INLINE uint64_t rng_draw(const struct rng *rng, size_t index, int draw) {
+        return mix64(rng->key + (2 * (uint64_t)index + (uint64_t)draw + 1) * GOLDEN_GAMMA);
+}
+
+/*
+ * Convert a probability to the threshold that makes chance return true
+ * with that probability.
+ */
+static uint64_t chance_threshold(double probability) {
+        if (!(probability > 0)) {
+                return 0;
+        } else if (probability >= 1) {
+                return UINT64_C(1) << CHANCE_BITS;
+        }
+        return (uint64_t)ceil(ldexp(probability, CHANCE_BITS));
+}
+
+static struct chances chances_for(const struct settings *settings) {
+        struct chances chances = {
+                .lethality = chance_threshold(settings->lethality),
+                .infectiousness = chance_threshold(settings->infectiousness),
+                .immunization = chance_threshold(settings->immunization_chance),
+        };
+        return chances;
+}
+
+/*
+ * Randomly return true with the probability a threshold was made from.
+ */
+static ALWAYS_INLINE bool chance(uint64_t threshold, uint64_t random) {
+        return (random >> (64 - CHANCE_BITS)) < threshold;
+}
+
+/*
+ * Find the chances that are certain to fail or to pass. A threshold of
+ * zero never passes and a threshold of the full range always does,
+ * whatever the draw, so leaving those draws out changes nothing: each
+ * draw depends only on the step, the cell and which draw it is.
+ */
+static int kernel_for(const struct chances *chances) {
+        int kernel = 0;
+        if (chances->lethality == 0) {
+                kernel |= KERNEL_NO_DEATHS;
+        }
+        if (chances->immunization >= UINT64_C(1) << CHANCE_BITS) {
+                kernel |= KERNEL_SURE_CURE;
+        }
+        return kernel;
+}
+
+#ifndef NO_ALLEGRO
+static double interpolate(double min, double max, int maxval, int currval) {
+        return min+(((max - min)/maxval)*currval);
+}
+#endif
+
+
+////////////////////////////////
+/////[SIMULATION FUNCTIONS]/////
+////////////////////////////////
+
+static void *step_worker(void *arg);
+
+static enum simd detect_simd(void) {
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                return SIMD_AVX2;
+        } else if (__builtin_cpu_supports("sse2")) {
+                return SIMD_SSE2;
+        }
+#endif
+        return SIMD_NONE;
+}
+
+static size_t grid_cell_size(const struct simulation *simulation) {
+        return simulation->compact ? sizeof(int8_t) : sizeof(int);
+}
+
+static void create_simulation(struct settings *settings, struct simulation *simulation) {
+        simulation->dimension = settings->simulation_grid_dimension;
+        simulation->compact = settings->max_infected_value <= COMPACT_MAX_INFECTED_VALUE;
+        simulation->engine = settings->engine;
+        simulation->simd = settings->use_simd ? detect_simd() : SIMD_NONE;
+
+        // Zeroed so that the borders start out, and stay, healthy
+        size_t cell_size = simulation->compact ? sizeof(int8_t) : sizeof(int);
+        simulation->state = alloc_grid(grid_cells(simulation->dimension) * cell_size);
+        must_init(simulation->state != NULL, "simulation state");
+        simulation->next_state = NULL;
+        if (simulation->engine != ENGINE_BITBOARD && simulation->engine != ENGINE_EVENT) {
+                simulation->next_state = alloc_grid(grid_cells(simulation->dimension) * cell_size);
+                must_init(simulation->next_state != NULL, "simulation state");
+        }
+        simulation->step = 0;
+        simulation->settings = settings;
+
+        simulation->tiles = 0;
+        simulation->tile_active = simulation->tile_next_active = simulation->tile_stale = NULL;
+        simulation->tile_infected = NULL;
+        if (simulation->engine == ENGINE_SPARSE) {
+                int tiles = (simulation->dimension + TILE_SIZE - 1) / TILE_SIZE;
+                simulation->tiles = tiles;
+                simulation->tile_active = malloc(sizeof(bool) * tiles * tiles);
+                must_init(simulation->tile_active != NULL, "tile flags");
+                simulation->tile_next_active = malloc(sizeof(bool) * tiles * tiles);
+                must_init(simulation->tile_next_active != NULL, "tile flags");
+                simulation->tile_stale = malloc(sizeof(bool) * tiles * tiles);
+                must_init(simulation->tile_stale != NULL, "tile flags");
+        }
+
+        simulation->words = 0;
+        simulation->infected = simulation->next_infected = simulation->healthy = NULL;
+        if (simulation->engine == ENGINE_BITBOARD) {
+                int words = (simulation->dimension + 63) / 64;
+                size_t plane_size = sizeof(uint64_t) * plane_words(simulation->dimension, words);
+                simulation->words = words;
+                simulation->infected = alloc_grid(plane_size);
+                must_init(simulation->infected != NULL, "bitplanes");
+                simulation->next_infected = alloc_grid(plane_size);
+                must_init(simulation->next_infected != NULL, "bitplanes");
+                simulation->healthy = alloc_grid(plane_size);
+                must_init(simulation->healthy != NULL, "bitplanes");
+        }
+
+        simulation->radius = 0;
+        simulation->infection_chances = NULL;
+        simulation->chances_infectiousness = NAN;
+        if (settings->neighbourhood == NEIGHBOURHOOD_MOORE) {
+                int side = 2*settings->radius + 1;
+                simulation->radius = settings->radius;
+                simulation->infection_chances = malloc(sizeof(uint64_t) * side * side);
+                must_init(simulation->infection_chances != NULL, "infection chances");
+        }
+
+        simulation->events = NULL;
+        simulation->event_count = simulation->event_capacity = 0;
+        simulation->generations = NULL;
+        if (simulation->engine == ENGINE_EVENT) {
+                simulation->generations = alloc_grid((size_t)simulation->dimension * simulation->dimension);
+                must_init(simulation->generations != NULL, "cell generations");
+        }
+
+        // Never use more threads than rows
+        int threads = settings->threads;
+        if (threads > simulation->dimension) {
+                threads = simulation->dimension;
+        }
+        if (threads < 1 || simulation->engine == ENGINE_EVENT) {
+                threads = 1;
+        }
+        simulation->threads = threads;
+        simulation->quit = false;
+        simulation->bands = malloc(sizeof(struct step_band) * threads);
+        must_init(simulation->bands != NULL, "step bands");
+        for (int i=0; i<threads; i++) {
+                simulation->bands[i].simulation = simulation;
+                simulation->bands[i].first_row = (int)((long)simulation->dimension * i / threads);
+                simulation->bands[i].end_row = (int)((long)simulation->dimension * (i+1) / threads);
+                simulation->bands[i].column_counts = NULL;
+                if (simulation->radius > 0) {
+                        simulation->bands[i].column_counts =
+                                malloc(sizeof(int) * ((size_t)simulation->dimension + 2*simulation->radius));
+                        must_init(simulation->bands[i].column_counts != NULL, "column counts");
+                }
+        }
+
+        if (threads > 1) {
+                must_init(pthread_barrier_init(&simulation->step_start, NULL, threads) == 0,
+                          "step barrier");
+                must_init(pthread_barrier_init(&simulation->step_done, NULL, threads) == 0,
+                          "step barrier");
+                for (int i=1; i<threads; i++) {
+                        must_init(pthread_create(&simulation->bands[i].thread, NULL,
+                                                 step_worker, &simulation->bands[i]) == 0,
+                                  "step thread");
+                }
+        }
+}
+
+static void destroy_simulation(struct simulation *simulation) {
+        if (simulation->threads > 1) {
+                simulation->quit = true;
+                pthread_barrier_wait(&simulation->step_start);
+                for (int i=1; i<simulation->threads; i++) {
+                        pthread_join(simulation->bands[i].thread, NULL);
+                }
+                pthread_barrier_destroy(&simulation->step_start);
+                pthread_barrier_destroy(&simulation->step_done);
+        }
+        for (int i=0; i<simulation->threads; i++) {
+                free(simulation->bands[i].column_counts);
+        }
+        free(simulation->bands);
+        simulation->bands = NULL;
+        free(simulation->infection_chances);
+        simulation->infection_chances = NULL;
+
+        free(simulation->tile_active);
+        free(simulation->tile_next_active);
+        free(simulation->tile_stale);
+        free(simulation->tile_infected);
+        simulation->tile_active = simulation->tile_next_active = simulation->tile_stale = NULL;
+        simulation->tile_infected = NULL;
+
+        size_t plane_size = sizeof(uint64_t) * plane_words(simulation->dimension, simulation->words);
+        free_grid(simulation->infected, plane_size);
+        free_grid(simulation->next_infected, plane_size);
+        free_grid(simulation->healthy, plane_size);
+        simulation->infected = simulation->next_infected = simulation->healthy = NULL;
+
+        free(simulation->events);
+        simulation->events = NULL;
+        free_grid(simulation->generations, (size_t)simulation->dimension * simulation->dimension);
+        simulation->generations = NULL;
+
+        size_t grid_size = grid_cell_size(simulation) * grid_cells(simulation->dimension);
+        free_grid(simulation->state, grid_size);
+        free_grid(simulation->next_state, grid_size);
+        simulation->state = simulation->next_state = NULL;
+}
+
+/*
+ * Recompute the tile flags of the sparse engine from the current grid.
+ * The other grid is treated as holding anything.
+ */
+static void reset_tiles(struct simulation *simulation) {
+        int dim = simulation->dimension;
+        int tiles = simulation->tiles;
+
+        for (int t=0; t<tiles*tiles; t++) {
+                simulation->tile_active[t] = false;
+                simulation->tile_stale[t] = true;
+        }
+
+        for (int i=0; i<dim; i++) {
+                for (int j=0; j<dim; j++) {
+                        if (load_cell(simulation->state, grid_index(dim, i, j), simulation->compact) > 0) {
+                                simulation->tile_active[j/TILE_SIZE + (i/TILE_SIZE)*tiles] = true;
+                        }
+                }
+        }
+}
+
+/*
+ * Recompute the bitplanes of the bitboard engine from the current grid.
+ */
+static void reset_bitboard(struct simulation *simulation) {
+        int dim = simulation->dimension;
+        int words = simulation->words;
+        size_t size = sizeof(uint64_t) * plane_words(dim, words);
+
+        memset(simulation->infected, 0, size);
+        memset(simulation->next_infected, 0, size);
+        memset(simulation->healthy, 0, size);
+
+        for (int i=0; i<dim; i++) {
+                for (int j=0; j<dim; j++) {
+                        int cell = load_cell(simulation->state, grid_index(dim, i, j), simulation->compact);
+                        uint64_t bit = UINT64_C(1) << (j % 64);
+                        if (cell > 0) {
+                                simulation->infected[plane_index(words, i, j / 64)] |= bit;
+                        } else if (cell == 0) {
+                                simulation->healthy[plane_index(words, i, j / 64)] |= bit;
+                        }
+                }
+        }
+}
+
+// Step of transitions that will never happen
+#define NEVER (UINT64_MAX >> 2)
+
+/*
+ * Events are ordered by step, and within a step infections go before
+ * deaths and cures, see step_events.
+ */
+static uint64_t event_key(uint64_t step, enum event_kind kind) {
+        return step << 1 | (kind != EVENT_INFECTION);
+}
+
+static void push_event(struct simulation *simulation, struct event event) {
+        if (simulation->event_count == simulation->event_capacity) {
+                simulation->event_capacity = MAX(1024, simulation->event_capacity * 2);
+                simulation->events = realloc(simulation->events,
+                                             sizeof(struct event) * simulation->event_capacity);
+                must_init(simulation->events != NULL, "event queue");
+        }
+
+        struct event *events = simulation->events;
+        size_t i = simulation->event_count++;
+        while (i > 0 && events[(i-1)/2].key > event.key) {
+                events[i] = events[(i-1)/2];
+                i = (i-1)/2;
+        }
+        events[i] = event;
+}
+
+static struct event pop_event(struct simulation *simulation) {
+        struct event *events = simulation->events;
+        struct event top = events[0];
+        struct event last = events[--simulation->event_count];
+        size_t count = simulation->event_count;
+
+        size_t i = 0;
+        for (;;) {
+                size_t child = 2*i + 1;
+                if (child >= count) {
+                        break;
+                }
+                if (child+1 < count && events[child+1].key < events[child].key) {
+                        child++;
+                }
+                if (events[child].key >= last.key) {
+                        break;
+                }
+                events[i] = events[child];
+                i = child;
+        }
+        if (count > 0) {
+                events[i] = last;
+        }
+        return top;
+}
+
+/*
+ * Number of tries up to and including the first success, for tries
+ * that succeed with the given probability, or NEVER.
+ */
+static uint64_t geometric(double probability, uint64_t random) {
+        if (!(probability > 0)) {
+                return NEVER;
+        } else if (probability >= 1) {
+                return 1;
+        }
+
+        // Uniform in (0, 1]
+        double uniform = ldexp((double)((random >> 11) + 1), -CHANCE_BITS);
+        double failures = floor(log(uniform) / log1p(-probability));
+        return failures < (double)(NEVER/2) ? (uint64_t)failures + 1 : NEVER;
+}
+
+static int infected_neighbours(const struct simulation *simulation, int x, int y) {
+        int dim = simulation->dimension;
+        bool compact = simulation->compact;
+
+        return isinfected(simulation->state, x-1, y, dim, compact) +
+               isinfected(simulation->state, x+1, y, dim, compact) +
+               isinfected(simulation->state, x, y-1, dim, compact) +
+               isinfected(simulation->state, x, y+1, dim, compact);
+}
+
+/*
+ * Schedule the infection of a healthy cell next to an infected one, at
+ * the first step from first_step on that it passes the infectiousness
+ * chance.
+ */
+static void schedule_infection(struct simulation *simulation, const struct rng *rng,
+                               size_t cell, uint64_t first_step) {
+        uint64_t wait = geometric(simulation->settings->infectiousness, rng_draw(rng, cell, 0));
+        push_event(simulation, (struct event){
+                .key = event_key(wait == NEVER ? NEVER : first_step + wait - 1, EVENT_INFECTION),
+                .cell = cell,
+                .generation = simulation->generations[cell],
+        });
+}
+
+/*
+ * Schedule the death or cure of a cell infected at infected_step, of
+ * whichever comes first from its first_age'th step infected on. It
+ * passes or fails the lethality chance every step, and the
+ * immunization one every step from 'immunity' on, with death winning
+ * a tie. Cells that can't die nor be cured still get an event, to
+ * keep track of their age.
+ */
+static void schedule_removal(struct simulation *simulation, const struct rng *rng,
+                             size_t cell, int64_t infected_step, int first_age) {
+        const struct settings *settings = simulation->settings;
+        uint64_t first_step = infected_step + first_age - 1;
+        uint64_t first_cure_step = infected_step + MAX(first_age, settings->max_infected_value) - 1;
+
+        uint64_t death_wait = geometric(settings->lethality, rng_draw(rng, cell, 0));
+        uint64_t cure_wait = geometric(settings->immunization_chance, rng_draw(rng, cell, 1));
+        uint64_t death = death_wait == NEVER ? NEVER : first_step + death_wait;
+        uint64_t cure = cure_wait == NEVER ? NEVER : first_cure_step + cure_wait;
+
+        enum event_kind kind = death <= cure ? EVENT_DEATH : EVENT_CURE;
+        push_event(simulation, (struct event){
+                .key = event_key(MIN(death, cure), kind),
+                .cell = cell,
+                .infected_step = infected_step,
+                .kind = kind,
+        });
+}
+
+static const int neighbour_dx[4] = {-1, 1, 0, 0};
+static const int neighbour_dy[4] = {0, 0, -1, 1};
+
+/*
+ * Whether x,y is inside the grid and healthy.
+ */
+static bool ishealthy(const struct simulation *simulation, int x, int y) {
+        int dim = simulation->dimension;
+        return x >= 0 && x < dim && y >= 0 && y < dim &&
+               load_cell(simulation->state, grid_index(dim, x, y), simulation->compact) == 0;
+}
+
+/*
+ * Schedule every transition that can happen from the current grid.
+ * Infected cells are taken to have been infected for as many steps as
+ * their state says, and as both chances are the same every step, the
+ * ones that have been so for longer behave just the same. Healthy
+ * cells are scheduled by the first of their infected neighbours.
+ */
+static void reset_events(struct simulation *simulation) {
+        int dim = simulation->dimension;
+        struct rng rng = rng_for_step(simulation->settings->rng_seed, simulation->step);
+
+        simulation->event_count = 0;
+        memset(simulation->generations, 0, (size_t)dim * dim);
+
+        for (int i=0; i<dim; i++) {
+                for (int j=0; j<dim; j++) {
+                        int state = load_cell(simulation->state, grid_index(dim, i, j), simulation->compact);
+                        if (state <= 0) {
+                                continue;
+                        }
+
+                        schedule_removal(simulation, &rng, (size_t)j + (size_t)i * dim,
+                                         (int64_t)simulation->step - state, state);
+
+                        for (int k=0; k<4; k++) {
+                                int nx = i + neighbour_dx[k], ny = j + neighbour_dy[k];
+                                if (!ishealthy(simulation, nx, ny)) {
+                                        continue;
+                                }
+
+                                int first = 0;
+                                while (!isinfected(simulation->state, nx + neighbour_dx[first],
+                                                   ny + neighbour_dy[first], dim, simulation->compact)) {
+                                        first++;
+                                }
+                                if (nx + neighbour_dx[first] == i && ny + neighbour_dy[first] == j) {
+                                        schedule_infection(simulation, &rng, (size_t)ny + (size_t)nx * dim,
+                                                           simulation->step);
+                                }
+                        }
+                }
+        }
+}
+
+/*
+ * Process the events of the current step. Whether a cell is infected
+ * or next to an infected cell is decided by the grid before the step,
+ * which is why infections go first: cells that die or are cured this
+ * step still count as infected for them. A healthy cell that is left
+ * with no infected neighbours moves on to a new generation, which
+ * voids its scheduled infection.
+ */
+static void step_events(struct simulation *simulation, struct transitions *transitions) {
+        int dim = simulation->dimension;
+        bool compact = simulation->compact;
+        uint64_t step = simulation->step;
+        struct rng rng = simulation->rng;
+
+        transitions->infections = transitions->deaths = transitions->cures = 0;
+        while (simulation->event_count > 0 && simulation->events[0].key < event_key(step+1, EVENT_INFECTION)) {
+                struct event event = pop_event(simulation);
+                int x = (int)(event.cell / dim);
+                int y = (int)(event.cell % dim);
+                size_t index = grid_index(dim, x, y);
+
+                if (event.kind == EVENT_INFECTION) {
+                        if (event.generation != simulation->generations[event.cell] ||
+                            load_cell(simulation->state, index, compact) != 0) {
+                                continue;
+                        }
+
+                        store_cell(simulation->state, index, 1, compact);
+                        transitions->infections++;
+                        schedule_removal(simulation, &rng, event.cell, step, 1);
+
+                        for (int k=0; k<4; k++) {
+                                int nx = x + neighbour_dx[k], ny = y + neighbour_dy[k];
+                                if (!ishealthy(simulation, nx, ny)) {
+                                        continue;
+                                }
+                                // Only just exposed if this is its sole infected neighbour
+                                if (infected_neighbours(simulation, nx, ny) == 1) {
+                                        schedule_infection(simulation, &rng, (size_t)ny + (size_t)nx * dim, step+1);
+                                }
+                        }
+                } else {
+                        bool death = event.kind == EVENT_DEATH;
+                        store_cell(simulation->state, index, death ? DEAD_STATE : CURED_STATE, compact);
+                        if (death) {
+                                transitions->deaths++;
+                        } else {
+                                transitions->cures++;
+                        }
+
+                        for (int k=0; k<4; k++) {
+                                int nx = x + neighbour_dx[k], ny = y + neighbour_dy[k];
+                                if (!ishealthy(simulation, nx, ny)) {
+                                        continue;
+                                }
+                                if (infected_neighbours(simulation, nx, ny) == 0) {
+                                        simulation->generations[(size_t)ny + (size_t)nx * dim]++;
+                                }
+                        }
+                }
+        }
+}
+
+/*
+ * The event engine leaves infected cells at 1 in the grid. Set them to
+ * their age, for when the grid itself is needed.
+ */
+static void sync_grid(struct simulation *simulation) {
+        if (simulation->engine != ENGINE_EVENT) {
+                return;
+        }
+
+        int dim = simulation->dimension;
+        int max_infected_value = simulation->settings->max_infected_value;
+        for (size_t i=0; i<simulation->event_count; i++) {
+                const struct event *event = &simulation->events[i];
+                if (event->kind != EVENT_INFECTION) {
+                        int64_t age = (int64_t)simulation->step - event->infected_step;
+                        store_cell(simulation->state,
+                                   grid_index(dim, (int)(event->cell / dim), (int)(event->cell % dim)),
+                                   (int)MIN(age, max_infected_value), simulation->compact);
+                }
+        }
+}
+
+/*
+ * Bring what the engine keeps track of besides the grid in line with
+ * the grid.
+ */
+static void reset_engine(struct simulation *simulation) {
+        if (simulation->engine == ENGINE_SPARSE) {
+                reset_tiles(simulation);
+        } else if (simulation->engine == ENGINE_BITBOARD) {
+                reset_bitboard(simulation);
+        } else if (simulation->engine == ENGINE_EVENT) {
+                reset_events(simulation);
+        }
+}
+
+static void init_simulation(struct simulation *simulation) {
+        int dim = simulation->dimension;
+        memset(simulation->state, 0, grid_cell_size(simulation)*grid_cells(dim));
+        int mid = dim/2;
+        store_cell(simulation->state, grid_index(dim, mid, mid), 1, simulation->compact);
+        simulation->step = 0;
+        tally_state(simulation, &simulation->tally);
+        simulation->transitions = (struct transitions){0, 0, 0};
+        reset_engine(simulation);
+}
+
+/*
+ * Compute the next state of an infected cell, counting the transition
+ * if there is one. kernel is a constant in each step kernel, see enum
+ * kernel.
+ */
+static ALWAYS_INLINE int advance_infected(int cell, int max_infected_value,
+                                          const struct rng *rng, const struct chances *chances,
+                                          struct transitions *transitions, size_t cell_number,
+                                          int kernel) {
+        if (!(kernel & KERNEL_NO_DEATHS) &&
+            chance(chances->lethality, rng_draw(rng, cell_number, 0))) {
+                transitions->deaths++;
+                return DEAD_STATE;
+        }
+
+        int next_cell = cell+1;
+        if (next_cell > max_infected_value) {
+                if ((kernel & KERNEL_SURE_CURE) ||
+                    chance(chances->immunization, rng_draw(rng, cell_number, 1))) {
+                        transitions->cures++;
+                        return CURED_STATE;
+                }
+                return max_infected_value;
+        }
+        return next_cell;
+}
+
+/*
+ * Compute the next state of a cell, store it, count the transition if
+ * there is one and return it. Random draws are keyed by the cell's
+ * position ignoring the border.
+ */
+static ALWAYS_INLINE int advance_state(const void *current, void *next, int max_infected_value,
+                                       const struct rng *rng, const struct chances *chances,
+                                       struct transitions *transitions,
+                                       int x, int y, int size, bool compact, int kernel) {
+        size_t index = grid_index(size, x, y);
+        size_t cell_number = (size_t)y + (size_t)x * size;
+        int cell = load_cell(current, index, compact);
+        int next_cell;
+        if (cell == CURED_STATE || cell == DEAD_STATE) {
+                next_cell = cell;
+        } else if (cell != 0) {
+                next_cell = advance_infected(cell, max_infected_value, rng, chances, transitions,
+                                             cell_number, kernel);
+        } else {
+                if (isinfected(current, x-1, y, size, compact) ||
+                    isinfected(current, x+1, y, size, compact) ||
+                    isinfected(current, x, y-1, size, compact) ||
+                    isinfected(current, x, y+1, size, compact)) {
+                        if (chance(chances->infectiousness, rng_draw(rng, cell_number, 0))) {
+                                next_cell = 1;
+                                transitions->infections++;
+                        } else {
+                                next_cell = 0;
+                        }
+                } else {
+                        next_cell = 0;
+                }
+        }
+        store_cell(next, index, next_cell, compact);
+        return next_cell;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Make the random draws for the lanes of a vector of compact cells
+ * that need them, exactly as advance_state would. Lanes in draw_mask
+ * are infected or healthy next to an infected cell, and lanes in
+ * cure_mask are infected for 'immunity' steps. The vector kernels
+ * have already stored the outcome of every lane with no draw going
+ * its way, which with KERNEL_SURE_CURE includes the cures; without
+ * deaths, draw_mask only holds healthy lanes.
+ */
+static ALWAYS_INLINE void draw_lanes(const int8_t *current, int8_t *next,
+                                     const struct rng *rng, const struct chances *chances,
+                                     struct transitions *transitions,
+                                     size_t cell_number, uint32_t draw_mask, uint32_t cure_mask,
+                                     int kernel) {
+        while (draw_mask != 0) {
+                int lane = __builtin_ctz(draw_mask);
+                draw_mask &= draw_mask - 1;
+
+                uint64_t random = rng_draw(rng, cell_number + lane, 0);
+                if (!(kernel & KERNEL_NO_DEATHS) && current[lane] > 0) {
+                        if (chance(chances->lethality, random)) {
+                                next[lane] = DEAD_STATE;
+                                transitions->deaths++;
+                                cure_mask &= ~(UINT32_C(1) << lane);
+                        }
+                } else if (chance(chances->infectiousness, random)) {
+                        next[lane] = 1;
+                        transitions->infections++;
+                }
+        }
+
+        if (kernel & KERNEL_SURE_CURE) {
+                transitions->cures += __builtin_popcount(cure_mask);
+                return;
+        }
+        while (cure_mask != 0) {
+                int lane = __builtin_ctz(cure_mask);
+                cure_mask &= cure_mask - 1;
+
+                if (chance(chances->immunization, rng_draw(rng, cell_number + lane, 1))) {
+                        next[lane] = CURED_STATE;
+                        transitions->cures++;
+                }
+        }
+}
+
+/*
+ * Step columns [first_col, end_col) of row x of a compact grid 32
+ * cells at a time. Every lane gets its deterministic outcome: terminal
+ * and healthy cells are kept and infected ones age, up to 'immunity'.
+ * Only then are random draws made for the lanes that need one.
+ * Returns whether any of the cells is left infected.
+ */
+__attribute__((target("avx2")))
+static ALWAYS_INLINE bool step_kernel_avx2(const int8_t *current, int8_t *next, int max_infected_value,
+                                           const struct rng *rng, const struct chances *chances,
+                                           struct transitions *transitions,
+                                           int x, int first_col, int end_col, int dim, int kernel) {
+        size_t stride = (size_t)dim + 2;
+        size_t row = grid_index(dim, x, 0);
+        size_t row_number = (size_t)x * dim;
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi8(1);
+        const __m256i max = _mm256_set1_epi8((char)max_infected_value);
+        const __m256i below_max = _mm256_set1_epi8((char)(max_infected_value - 1));
+        const __m256i cured = _mm256_set1_epi8((char)CURED_STATE);
+        __m256i left_infected = zero;
+
+        int j = first_col;
+        for (; j + 32 <= end_col; j += 32) {
+                const int8_t *c = current + row + j;
+                int8_t *n = next + row + j;
+
+                __m256i cell = _mm256_loadu_si256((const __m256i *)c);
+                __m256i up = _mm256_loadu_si256((const __m256i *)(c - stride));
+                __m256i down = _mm256_loadu_si256((const __m256i *)(c + stride));
+                __m256i left = _mm256_loadu_si256((const __m256i *)(c - 1));
+                __m256i right = _mm256_loadu_si256((const __m256i *)(c + 1));
+
+                __m256i neighbours = _mm256_max_epi8(_mm256_max_epi8(up, down),
+                                                     _mm256_max_epi8(left, right));
+                __m256i infected = _mm256_cmpgt_epi8(cell, zero);
+                __m256i exposed = _mm256_and_si256(_mm256_cmpeq_epi8(cell, zero),
+                                                   _mm256_cmpgt_epi8(neighbours, zero));
+                __m256i aged = _mm256_min_epi8(_mm256_adds_epi8(cell, one), max);
+                __m256i cures = _mm256_and_si256(infected, _mm256_cmpgt_epi8(cell, below_max));
+                if (kernel & KERNEL_SURE_CURE) {
+                        aged = _mm256_blendv_epi8(aged, cured, cures);
+                }
+                _mm256_storeu_si256((__m256i *)n, _mm256_blendv_epi8(cell, aged, infected));
+
+                uint32_t draw_mask = (uint32_t)_mm256_movemask_epi8(
+                        kernel & KERNEL_NO_DEATHS ? exposed : _mm256_or_si256(infected, exposed));
+                uint32_t cure_mask = (uint32_t)_mm256_movemask_epi8(cures);
+                // Infected lanes make no draw without deaths, but may be left infected
+                uint32_t live_mask = kernel & KERNEL_NO_DEATHS ?
+                        draw_mask | (uint32_t)_mm256_movemask_epi8(infected) : draw_mask;
+                if ((live_mask | cure_mask) != 0) {
+                        draw_lanes(c, n, rng, chances, transitions, row_number + j, draw_mask, cure_mask,
+                                   kernel);
+                        left_infected = _mm256_or_si256(left_infected,
+                                                        _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *)n), zero));
+                }
+        }
+
+        bool any = !_mm256_testz_si256(left_infected, left_infected);
+        for (; j < end_col; j++) {
+                any |= advance_state(current, next, max_infected_value, rng, chances, transitions,
+                                     x, j, dim, true, kernel) > 0;
+        }
+        return any;
+}
+
+__attribute__((target("avx2")))
+static bool step_span_avx2(const int8_t *current, int8_t *next, int max_infected_value,
+                           const struct rng *rng, const struct chances *chances,
+                           struct transitions *transitions,
+                           int x, int first_col, int end_col, int dim, int kernel) {
+        switch (kernel) {
+        case KERNEL_NO_DEATHS:
+                return step_kernel_avx2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_NO_DEATHS);
+        case KERNEL_SURE_CURE:
+                return step_kernel_avx2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_SURE_CURE);
+        case KERNEL_NO_DEATHS | KERNEL_SURE_CURE:
+                return step_kernel_avx2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_NO_DEATHS | KERNEL_SURE_CURE);
+        default:
+                return step_kernel_avx2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, 0);
+        }
+}
+
+/*
+ * As step_kernel_avx2, 16 cells at a time with only SSE2, which lacks
+ * signed byte min, max and blend.
+ */
+__attribute__((target("sse2")))
+static ALWAYS_INLINE bool step_kernel_sse2(const int8_t *current, int8_t *next, int max_infected_value,
+                                           const struct rng *rng, const struct chances *chances,
+                                           struct transitions *transitions,
+                                           int x, int first_col, int end_col, int dim, int kernel) {
+        size_t stride = (size_t)dim + 2;
+        size_t row = grid_index(dim, x, 0);
+        size_t row_number = (size_t)x * dim;
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi8(1);
+        const __m128i max = _mm_set1_epi8((char)max_infected_value);
+        const __m128i below_max = _mm_set1_epi8((char)(max_infected_value - 1));
+        const __m128i cured = _mm_set1_epi8((char)CURED_STATE);
+        __m128i left_infected = zero;
+
+        int j = first_col;
+        for (; j + 16 <= end_col; j += 16) {
+                const int8_t *c = current + row + j;
+                int8_t *n = next + row + j;
+
+                __m128i cell = _mm_loadu_si128((const __m128i *)c);
+                __m128i up = _mm_loadu_si128((const __m128i *)(c - stride));
+                __m128i down = _mm_loadu_si128((const __m128i *)(c + stride));
+                __m128i left = _mm_loadu_si128((const __m128i *)(c - 1));
+                __m128i right = _mm_loadu_si128((const __m128i *)(c + 1));
+
+                __m128i neighbours = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi8(up, zero),
+                                                               _mm_cmpgt_epi8(down, zero)),
+                                                  _mm_or_si128(_mm_cmpgt_epi8(left, zero),
+                                                               _mm_cmpgt_epi8(right, zero)));
+                __m128i infected = _mm_cmpgt_epi8(cell, zero);
+                __m128i exposed = _mm_and_si128(_mm_cmpeq_epi8(cell, zero), neighbours);
+                __m128i aged = _mm_adds_epi8(cell, one);
+                __m128i over = _mm_cmpgt_epi8(aged, max);
+                aged = _mm_or_si128(_mm_and_si128(over, max), _mm_andnot_si128(over, aged));
+                __m128i cures = _mm_and_si128(infected, _mm_cmpgt_epi8(cell, below_max));
+                if (kernel & KERNEL_SURE_CURE) {
+                        aged = _mm_or_si128(_mm_and_si128(cures, cured), _mm_andnot_si128(cures, aged));
+                }
+                _mm_storeu_si128((__m128i *)n, _mm_or_si128(_mm_and_si128(infected, aged),
+                                                            _mm_andnot_si128(infected, cell)));
+
+                uint32_t draw_mask = (uint32_t)_mm_movemask_epi8(
+                        kernel & KERNEL_NO_DEATHS ? exposed : _mm_or_si128(infected, exposed));
+                uint32_t cure_mask = (uint32_t)_mm_movemask_epi8(cures);
+                // Infected lanes make no draw without deaths, but may be left infected
+                uint32_t live_mask = kernel & KERNEL_NO_DEATHS ?
+                        draw_mask | (uint32_t)_mm_movemask_epi8(infected) : draw_mask;
+                if ((live_mask | cure_mask) != 0) {
+                        draw_lanes(c, n, rng, chances, transitions, row_number + j, draw_mask, cure_mask,
+                                   kernel);
+                        left_infected = _mm_or_si128(left_infected,
+                                                     _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)n), zero));
+                }
+        }
+
+        bool any = _mm_movemask_epi8(left_infected) != 0;
+        for (; j < end_col; j++) {
+                any |= advance_state(current, next, max_infected_value, rng, chances, transitions,
+                                     x, j, dim, true, kernel) > 0;
+        }
+        return any;
+}
+
+__attribute__((target("sse2")))
+static bool step_span_sse2(const int8_t *current, int8_t *next, int max_infected_value,
+                           const struct rng *rng, const struct chances *chances,
+                           struct transitions *transitions,
+                           int x, int first_col, int end_col, int dim, int kernel) {
+        switch (kernel) {
+        case KERNEL_NO_DEATHS:
+                return step_kernel_sse2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_NO_DEATHS);
+        case KERNEL_SURE_CURE:
+                return step_kernel_sse2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_SURE_CURE);
+        case KERNEL_NO_DEATHS | KERNEL_SURE_CURE:
+                return step_kernel_sse2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, KERNEL_NO_DEATHS | KERNEL_SURE_CURE);
+        default:
+                return step_kernel_sse2(current, next, max_infected_value, rng, chances, transitions,
+                                        x, first_col, end_col, dim, 0);
+        }
+}
+#endif
+
+/*
+ * Step columns [first_col, end_col) of row x, returning whether any of
+ * the cells is left infected.
+ */
+static ALWAYS_INLINE bool step_span(struct simulation *simulation, struct transitions *transitions,
+                                    int x, int first_col, int end_col, bool compact, int kernel) {
+        const void *current = simulation->state;
+        void *next = simulation->next_state;
+        int max_infected_value = simulation->settings->max_infected_value;
+        struct rng rng = simulation->rng;
+        struct chances chances = simulation->chances;
+        struct transitions counted = {0};
+        int dim = simulation->dimension;
+        bool infected = false;
+
+#ifdef HAVE_X86_SIMD
+        if (compact && simulation->simd == SIMD_AVX2) {
+                infected = step_span_avx2(current, next, max_infected_value, &rng, &chances, &counted,
+                                          x, first_col, end_col, dim, kernel);
+        } else if (compact && simulation->simd == SIMD_SSE2) {
+                infected = step_span_sse2(current, next, max_infected_value, &rng, &chances, &counted,
+                                          x, first_col, end_col, dim, kernel);
+        } else
+#endif
+        {
+                for (int j=first_col; j<end_col; j++) {
+                        infected |= advance_state(current, next, max_infected_value, &rng, &chances,
+                                                  &counted, x, j, dim, compact, kernel) > 0;
+                }
+        }
+
+        transitions->infections += counted.infections;
+        transitions->deaths += counted.deaths;
+        transitions->cures += counted.cures;
+        return infected;
+}
+
+static ALWAYS_INLINE void step_rows(struct simulation *simulation, struct transitions *transitions,
+                                    int first_row, int end_row, bool compact, int kernel) {
+        int dim = simulation->dimension;
+        int tiles = (dim + TILE_SIZE - 1) / TILE_SIZE;
+        bool *tile_infected = simulation->tile_infected;
+
+        for (int i=first_row; i<end_row; i++) {
+                if (tile_infected == NULL) {
+                        step_span(simulation, transitions, i, 0, dim, compact, kernel);
+                        continue;
+                }
+
+                // Bands can share a row of tiles
+                bool *row_tiles = &tile_infected[(i / TILE_SIZE) * tiles];
+                for (int tile_col=0; tile_col<tiles; tile_col++) {
+                        int first_col = tile_col * TILE_SIZE;
+                        if (step_span(simulation, transitions, i, first_col, MIN(dim, first_col + TILE_SIZE),
+                                      compact, kernel)) {
+                                __atomic_store_n(&row_tiles[tile_col], true, __ATOMIC_RELAXED);
+                        }
+                }
+        }
+}
+
+/*
+ * Work out the threshold to catch the infection from each number of
+ * infected neighbours, unless the infectiousness is the same as last
+ * time.
+ */
+static void update_infection_chances(struct simulation *simulation, double infectiousness) {
+        if (simulation->radius == 0 || infectiousness == simulation->chances_infectiousness) {
+                return;
+        }
+
+        int side = 2*simulation->radius + 1;
+        for (int infected=0; infected<side*side; infected++) {
+                simulation->infection_chances[infected] =
+                        chance_threshold(1 - pow(1 - infectiousness, infected));
+        }
+        simulation->chances_infectiousness = infectiousness;
+}
+
+/*
+ * Add or take away the infected individuals of a row to the count of
+ * their columns, rows outside the grid having none.
+ */
+static ALWAYS_INLINE void count_row(const void *state, int dim, int x, int *counts, int sign,
+                                    bool compact) {
+        if (x < 0 || x >= dim) {
+                return;
+        }
+        for (int y=0; y<dim; y++) {
+                counts[y] += sign * (load_cell(state, grid_index(dim, x, y), compact) > 0);
+        }
+}
+
+/*
+ * Step a band of rows with a Moore neighbourhood. Infected neighbours
+ * are counted with sliding windows: counts holds how many are infected
+ * in each column within the radius of the row being stepped, moved
+ * down by adding a row below and taking one away above, and the count
+ * for each individual is kept as the sum of the counts within the
+ * radius of its column, moved along by adding one column and taking
+ * one away. It takes the same few operations per individual whatever
+ * the radius. Healthy individuals aren't infected, so they never count
+ * themselves.
+ */
+static ALWAYS_INLINE void step_moore_rows(struct simulation *simulation, struct step_band *band,
+                                          bool compact, int kernel) {
+        const void *current = simulation->state;
+        void *next = simulation->next_state;
+        int max_infected_value = simulation->settings->max_infected_value;
+        const uint64_t *infection_chances = simulation->infection_chances;
+        struct rng rng = simulation->rng;
+        struct chances chances = simulation->chances;
+        struct transitions counted = {0};
+        int dim = simulation->dimension;
+        int radius = simulation->radius;
+        int tiles = (dim + TILE_SIZE - 1) / TILE_SIZE;
+        bool *tile_infected = simulation->tile_infected;
+
+        int *counts = band->column_counts + radius;
+        memset(band->column_counts, 0, sizeof(int) * ((size_t)dim + 2*radius));
+        for (int x=band->first_row-radius; x<band->first_row+radius; x++) {
+                count_row(current, dim, x, counts, 1, compact);
+        }
+
+        for (int x=band->first_row; x<band->end_row; x++) {
+                count_row(current, dim, x+radius, counts, 1, compact);
+
+                int infected = 0;
+                for (int y=-radius; y<radius; y++) {
+                        infected += counts[y];
+                }
+                for (int y=0; y<dim; y++) {
+                        infected += counts[y+radius];
+
+                        size_t index = grid_index(dim, x, y);
+                        size_t cell_number = (size_t)y + (size_t)x * dim;
+                        int cell = load_cell(current, index, compact);
+                        int next_cell = cell;
+                        if (cell > 0) {
+                                next_cell = advance_infected(cell, max_infected_value, &rng, &chances,
+                                                             &counted, cell_number, kernel);
+                        } else if (cell == 0 && infected > 0 &&
+                                   chance(infection_chances[infected], rng_draw(&rng, cell_number, 0))) {
+                                next_cell = 1;
+                                counted.infections++;
+                        }
+                        store_cell(next, index, next_cell, compact);
+                        if (next_cell > 0 && tile_infected != NULL) {
+                                __atomic_store_n(&tile_infected[(x / TILE_SIZE) * tiles + y / TILE_SIZE],
+                                                 true, __ATOMIC_RELAXED);
+                        }
+
+                        infected -= counts[y-radius];
+                }
+
+                count_row(current, dim, x-radius, counts, -1, compact);
+        }
+
+        band->transitions.infections += counted.infections;
+        band->transitions.deaths += counted.deaths;
+        band->transitions.cures += counted.cures;
+}
+
+/*
+ * Step the cells of a tile, returning whether any of them is left
+ * infected.
+ */
+static ALWAYS_INLINE bool step_tile(struct simulation *simulation, struct transitions *transitions,
+                                    int tile_row, int tile_col, bool compact, int kernel) {
+        int dim = simulation->dimension;
+        int first_row = tile_row * TILE_SIZE;
+        int end_row = MIN(dim, first_row + TILE_SIZE);
+        int first_col = tile_col * TILE_SIZE;
+        int end_col = MIN(dim, first_col + TILE_SIZE);
+        bool infected = false;
+
+        for (int i=first_row; i<end_row; i++) {
+                infected |= step_span(simulation, transitions, i, first_col, end_col, compact, kernel);
+        }
+
+        return infected;
+}
+
+/*
+ * Make the next grid match the current one over a tile that won't be
+ * stepped.
+ */
+static void copy_tile(struct simulation *simulation, int tile_row, int tile_col) {
+        int dim = simulation->dimension;
+        size_t cell_size = grid_cell_size(simulation);
+        int first_row = tile_row * TILE_SIZE;
+        int end_row = MIN(dim, first_row + TILE_SIZE);
+        int first_col = tile_col * TILE_SIZE;
+        int end_col = MIN(dim, first_col + TILE_SIZE);
+
+        for (int i=first_row; i<end_row; i++) {
+                size_t offset = cell_size * grid_index(dim, i, first_col);
+                memcpy((char *)simulation->next_state + offset,
+                       (const char *)simulation->state + offset,
+                       cell_size * (end_col - first_col));
+        }
+}
+
+static bool tile_can_change(const struct simulation *simulation, int tile_row, int tile_col) {
+        int tiles = simulation->tiles;
+        const bool *active = simulation->tile_active;
+
+        return active[tile_col + tile_row*tiles] ||
+                (tile_row > 0       && active[tile_col + (tile_row-1)*tiles]) ||
+                (tile_row < tiles-1 && active[tile_col + (tile_row+1)*tiles]) ||
+                (tile_col > 0       && active[tile_col-1 + tile_row*tiles]) ||
+                (tile_col < tiles-1 && active[tile_col+1 + tile_row*tiles]);
+}
+
+static ALWAYS_INLINE void step_active_tiles(struct simulation *simulation, struct transitions *transitions,
+                                            bool compact, int kernel) {
+        int tiles = simulation->tiles;
+
+        for (;;) {
+                int tile_row = __atomic_fetch_add(&simulation->next_tile_row, 1, __ATOMIC_RELAXED);
+                if (tile_row >= tiles) {
+                        break;
+                }
+
+                for (int tile_col=0; tile_col<tiles; tile_col++) {
+                        int t = tile_col + tile_row*tiles;
+                        if (tile_can_change(simulation, tile_row, tile_col)) {
+                                simulation->tile_next_active[t] = step_tile(simulation, transitions,
+                                                                            tile_row, tile_col, compact,
+                                                                            kernel);
+                                simulation->tile_stale[t] = true;
+                        } else {
+                                simulation->tile_next_active[t] = false;
+                                if (simulation->tile_stale[t]) {
+                                        copy_tile(simulation, tile_row, tile_col);
+                                        simulation->tile_stale[t] = false;
+                                }
+                        }
+                }
+        }
+}
+
+/*
+ * Step rows [first_row, end_row) with the bitboard engine. Healthy
+ * cells next to an infected one are found 64 at a time from the
+ * infected bitplane, and only they and the infected cells are visited.
+ * As neighbours are only ever looked up in the infected bitplane, the
+ * grid and the healthy bitplane are updated in place.
+ */
+static ALWAYS_INLINE void step_bitboard_rows(struct simulation *simulation, struct transitions *transitions,
+                                             int first_row, int end_row, bool compact, int kernel) {
+        void *state = simulation->state;
+        int max_infected_value = simulation->settings->max_infected_value;
+        struct rng rng = simulation->rng;
+        struct chances chances = simulation->chances;
+        struct transitions counted = {0};
+        int dim = simulation->dimension;
+        int words = simulation->words;
+        size_t stride = (size_t)words + 2;
+        const uint64_t *infected = simulation->infected;
+        uint64_t *next_infected = simulation->next_infected;
+        uint64_t *healthy = simulation->healthy;
+
+        for (int i=first_row; i<end_row; i++) {
+                for (int w=0; w<words; w++) {
+                        size_t p = plane_index(words, i, w);
+                        uint64_t cells = infected[p];
+                        uint64_t neighbours = infected[p - stride] | infected[p + stride] |
+                                (cells << 1) | (infected[p-1] >> 63) |
+                                (cells >> 1) | (infected[p+1] << 63);
+                        uint64_t exposed = healthy[p] & neighbours;
+                        uint64_t next = 0;
+                        int first_col = w*64;
+                        size_t first_cell = (size_t)i*dim + first_col;
+
+                        while (exposed != 0) {
+                                int bit = __builtin_ctzll(exposed);
+                                exposed &= exposed - 1;
+
+                                if (chance(chances.infectiousness, rng_draw(&rng, first_cell + bit, 0))) {
+                                        store_cell(state, grid_index(dim, i, first_col + bit), 1, compact);
+                                        next |= UINT64_C(1) << bit;
+                                        counted.infections++;
+                                }
+                        }
+                        healthy[p] &= ~next;
+
+                        while (cells != 0) {
+                                int bit = __builtin_ctzll(cells);
+                                cells &= cells - 1;
+
+                                size_t index = grid_index(dim, i, first_col + bit);
+                                int cell = advance_infected(load_cell(state, index, compact),
+                                                            max_infected_value, &rng, &chances, &counted,
+                                                            first_cell + bit, kernel);
+                                store_cell(state, index, cell, compact);
+                                if (cell > 0) {
+                                        next |= UINT64_C(1) << bit;
+                                }
+                        }
+
+                        next_infected[p] = next;
+                }
+        }
+
+        transitions->infections += counted.infections;
+        transitions->deaths += counted.deaths;
+        transitions->cures += counted.cures;
+}
+
+static ALWAYS_INLINE void step_band_kernel(struct step_band *band, int kernel) {
+        struct simulation *simulation = band->simulation;
+        struct transitions *transitions = &band->transitions;
+
+        if (simulation->engine == ENGINE_SPARSE) {
+                if (simulation->compact) {
+                        step_active_tiles(simulation, transitions, true, kernel);
+                } else {
+                        step_active_tiles(simulation, transitions, false, kernel);
+                }
+        } else if (simulation->engine == ENGINE_BITBOARD) {
+                if (simulation->compact) {
+                        step_bitboard_rows(simulation, transitions, band->first_row, band->end_row, true,
+                                           kernel);
+                } else {
+                        step_bitboard_rows(simulation, transitions, band->first_row, band->end_row, false,
+                                           kernel);
+                }
+        } else if (simulation->radius > 0) {
+                if (simulation->compact) {
+                        step_moore_rows(simulation, band, true, kernel);
+                } else {
+                        step_moore_rows(simulation, band, false, kernel);
+                }
+        } else {
+                if (simulation->compact) {
+                        step_rows(simulation, transitions, band->first_row, band->end_row, true, kernel);
+                } else {
+                        step_rows(simulation, transitions, band->first_row, band->end_row, false, kernel);
+                }
+        }
+}
+
+static void step_band(struct step_band *band) {
+        struct transitions *transitions = &band->transitions;
+
+        transitions->infections = transitions->deaths = transitions->cures = 0;
+        switch (band->simulation->kernel) {
+        case KERNEL_NO_DEATHS:
+                step_band_kernel(band, KERNEL_NO_DEATHS);
+                break;
+        case KERNEL_SURE_CURE:
+                step_band_kernel(band, KERNEL_SURE_CURE);
+                break;
+        case KERNEL_NO_DEATHS | KERNEL_SURE_CURE:
+                step_band_kernel(band, KERNEL_NO_DEATHS | KERNEL_SURE_CURE);
+                break;
+        default:
+                step_band_kernel(band, 0);
+                break;
+        }
+}
+
+/*
+ * Work out which tiles are left with an infected individual from what
+ * the engine keeps track of, in much less than the time it takes to
+ * look at every cell. The dense engine marks them as it steps.
+ */
+static void find_infected_tiles(struct simulation *simulation) {
+        int dim = simulation->dimension;
+        int tiles = (dim + TILE_SIZE - 1) / TILE_SIZE;
+        bool *tile_infected = simulation->tile_infected;
+
+        if (simulation->engine == ENGINE_SPARSE) {
+                memcpy(tile_infected, simulation->tile_active, sizeof(bool) * tiles * tiles);
+        } else if (simulation->engine == ENGINE_BITBOARD) {
+                memset(tile_infected, 0, sizeof(bool) * tiles * tiles);
+                for (int i=0; i<dim; i++) {
+                        bool *row_tiles = &tile_infected[(i / TILE_SIZE) * tiles];
+                        for (int w=0; w<simulation->words; w++) {
+                                if (simulation->infected[plane_index(simulation->words, i, w)] != 0) {
+                                        row_tiles[w * 64 / TILE_SIZE] = true;
+                                }
+                        }
+                }
+        } else if (simulation->engine == ENGINE_EVENT) {
+                // Everyone infected is waiting to die or be cured
+                memset(tile_infected, 0, sizeof(bool) * tiles * tiles);
+                for (size_t i=0; i<simulation->event_count; i++) {
+                        const struct event *event = &simulation->events[i];
+                        if (event->kind != EVENT_INFECTION) {
+                                int x = (int)(event->cell / dim);
+                                int y = (int)(event->cell % dim);
+                                tile_infected[(x / TILE_SIZE) * tiles + y / TILE_SIZE] = true;
+                        }
+                }
+        }
+}
+
+static void *step_worker(void *arg) {
+        struct step_band *band = arg;
+        struct simulation *simulation = band->simulation;
+
+        for (;;) {
+                pthread_barrier_wait(&simulation->step_start);
+                if (simulation->quit) {
+                        break;
+                }
+                step_band(band);
+                pthread_barrier_wait(&simulation->step_done);
+        }
+
+        return NULL;
+}
+
+static void simulation_step(struct settings *settings, struct simulation *simulation) {
+        uint64_t start = profile_begin();
+        simulation->settings = settings;
+        simulation->rng = rng_for_step(settings->rng_seed, simulation->step);
+        simulation->chances = chances_for(settings);
+        simulation->kernel = kernel_for(&simulation->chances);
+        update_infection_chances(simulation, settings->infectiousness);
+        simulation->next_tile_row = 0;
+        if (simulation->tile_infected != NULL && simulation->engine == ENGINE_DENSE) {
+                int tiles = (simulation->dimension + TILE_SIZE - 1) / TILE_SIZE;
+                memset(simulation->tile_infected, 0, sizeof(bool) * tiles * tiles);
+        }
+
+        if (simulation->engine == ENGINE_EVENT) {
+                step_events(simulation, &simulation->bands[0].transitions);
+        } else if (simulation->threads > 1) {
+                pthread_barrier_wait(&simulation->step_start);
+                step_band(&simulation->bands[0]);
+                pthread_barrier_wait(&simulation->step_done);
+        } else {
+                step_band(&simulation->bands[0]);
+        }
+
+        simulation->transitions = (struct transitions){0, 0, 0};
+        for (int i=0; i<simulation->threads; i++) {
+                const struct transitions *transitions = &simulation->bands[i].transitions;
+                apply_transitions(&simulation->tally, transitions);
+                simulation->transitions.infections += transitions->infections;
+                simulation->transitions.deaths += transitions->deaths;
+                simulation->transitions.cures += transitions->cures;
+        }
+
+        simulation->step++;
+        if (simulation->engine == ENGINE_EVENT) {
+                // The grid was updated in place
+        } else if (simulation->engine == ENGINE_BITBOARD) {
+                // The grid was updated in place
+                uint64_t *tmp_infected = simulation->infected;
+                simulation->infected = simulation->next_infected;
+                simulation->next_infected = tmp_infected;
+        } else {
+                void *tmp = simulation->state;
+                simulation->state = simulation->next_state;
+                simulation->next_state = tmp;
+        }
+
+        bool *tmp_active = simulation->tile_active;
+        simulation->tile_active = simulation->tile_next_active;
+        simulation->tile_next_active = tmp_active;
+        if (simulation->tile_infected != NULL) {
+                find_infected_tiles(simulation);
+        }
+        profile_end(PROFILE_STEP, start);
+}
+
+
+////////////////////////////////
+/////[CHECKPOINT FUNCTIONS]/////
+////////////////////////////////
+
+/*
+ * Map a checkpoint into memory and check that it's complete and
+ * consistent, printing what's wrong if it isn't.
+ */
+static bool open_checkpoint(const char *path, struct checkpoint *checkpoint) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "couldn't open checkpoint %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct checkpoint_header)) {
+                fprintf(stderr, "checkpoint %s is truncated\n", path);
+                close(fd);
+                return false;
+        }
+
+        checkpoint->size = st.st_size;
+        checkpoint->mapping = mmap(NULL, checkpoint->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (checkpoint->mapping == MAP_FAILED) {
+                fprintf(stderr, "couldn't map checkpoint %s: %s\n", path, strerror(errno));
+                return false;
+        }
+        checkpoint->header = checkpoint->mapping;
+        checkpoint->payload = checkpoint->header + 1;
+
+        const struct checkpoint_header *header = checkpoint->header;
+        const char *problem = NULL;
+        if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+                problem = "not a checkpoint";
+        } else if (header->version != CHECKPOINT_VERSION) {
+                problem = "unsupported version";
+        } else if (header->dimension < 1 || header->max_infected_value < 1) {
+                problem = "invalid settings";
+        } else if (header->cell_size != (header->max_infected_value <= COMPACT_MAX_INFECTED_VALUE ?
+                                         sizeof(int8_t) : sizeof(int))) {
+                problem = "cell size doesn't match immunity";
+        } else if (header->payload_size > checkpoint->size - sizeof(struct checkpoint_header)) {
+                problem = "truncated";
+        } else if (header->encoding == CHECKPOINT_RAW) {
+                if (header->payload_size != (uint64_t)header->dimension*header->dimension*header->cell_size) {
+                        problem = "grid size doesn't match dimension";
+                }
+        } else if (header->encoding != CHECKPOINT_RLE || header->payload_size % 8 != 0) {
+                problem = "invalid encoding";
+        }
+
+        if (problem != NULL) {
+                fprintf(stderr, "checkpoint %s: %s\n", path, problem);
+                munmap(checkpoint->mapping, checkpoint->size);
+                return false;
+        }
+        return true;
+}
+
+static void close_checkpoint(struct checkpoint *checkpoint) {
+        munmap(checkpoint->mapping, checkpoint->size);
+}
+
+/*
+ * Take the settings a checkpoint was started with, which it can only
+ * be continued with.
+ */
+static void apply_checkpoint_settings(const struct checkpoint *checkpoint, struct settings *settings) {
+        const struct checkpoint_header *header = checkpoint->header;
+        settings->simulation_grid_dimension = header->dimension;
+        settings->max_infected_value = header->max_infected_value;
+        settings->rng_seed = header->rng_seed;
+        settings->lethality = header->lethality;
+        settings->infectiousness = header->infectiousness;
+        settings->immunization_chance = header->immunization_chance;
+        settings->resume = checkpoint;
+}
+
+static bool valid_cell(int value, int max_infected_value) {
+        return value == CURED_STATE || value == DEAD_STATE ||
+               (value >= 0 && value <= max_infected_value);
+}
+
+/*
+ * Fill the grid of a simulation created with the settings of the
+ * checkpoint. Returns false if the grid is corrupt.
+ */
+static bool load_checkpoint(const struct checkpoint *checkpoint, struct simulation *simulation) {
+        const struct checkpoint_header *header = checkpoint->header;
+        int dim = simulation->dimension;
+        bool compact = simulation->compact;
+        size_t row_size = grid_cell_size(simulation) * dim;
+
+        memset(simulation->state, 0, grid_cell_size(simulation)*grid_cells(dim));
+
+        if (header->encoding == CHECKPOINT_RAW) {
+                const char *cells = checkpoint->payload;
+                for (int i=0; i<dim; i++) {
+                        memcpy((char *)simulation->state + grid_index(dim, i, 0)*grid_cell_size(simulation),
+                               cells + i*row_size, row_size);
+                        for (int j=0; j<dim; j++) {
+                                int value = load_cell(simulation->state, grid_index(dim, i, j), compact);
+                                if (!valid_cell(value, header->max_infected_value)) {
+                                        return false;
+                                }
+                        }
+                }
+        } else {
+                const uint32_t *runs = checkpoint->payload;
+                size_t nruns = header->payload_size / 8;
+                size_t cell = 0, cells = (size_t)dim*dim;
+                for (size_t r=0; r<nruns; r++) {
+                        uint32_t count = runs[2*r];
+                        int32_t value = (int32_t)runs[2*r+1];
+                        if (count > cells - cell || !valid_cell(value, header->max_infected_value)) {
+                                return false;
+                        }
+                        for (uint32_t k=0; k<count; k++, cell++) {
+                                store_cell(simulation->state, grid_index(dim, cell/dim, cell%dim), value, compact);
+                        }
+                }
+                if (cell != cells) {
+                        return false;
+                }
+        }
+
+        simulation->step = header->step;
+        tally_state(simulation, &simulation->tally);
+        simulation->transitions = (struct transitions){0, 0, 0};
+        reset_engine(simulation);
+        return true;
+}
+
+/*
+ * Start from the checkpoint to resume from if there is one, or else
+ * from a single infected individual.
+ */
+static void start_simulation(struct settings *settings, struct simulation *simulation) {
+        if (settings->resume == NULL) {
+                init_simulation(simulation);
+        } else if (!load_checkpoint(settings->resume, simulation)) {
+                fprintf(stderr, "checkpoint %s: corrupt grid\n", settings->resume_path);
+                exit(1);
+        }
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+        const char *bytes = data;
+        while (size > 0) {
+                ssize_t written = write(fd, bytes, size);
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                bytes += written;
+                size -= written;
+        }
+        return true;
+}
+
+static bool write_rle(int fd, const struct checkpoint_header *header, const void *cells,
+                      uint64_t *payload_size) {
+        bool compact = header->cell_size == sizeof(int8_t);
+        size_t count = (size_t)header->dimension * header->dimension;
+        uint32_t buffer[2*1024];
+        int buffered = 0;
+
+        *payload_size = 0;
+        for (size_t cell=0; cell<count;) {
+                int value = load_cell(cells, cell, compact);
+                uint32_t run = 1;
+                while (cell+run < count && run < UINT32_MAX && load_cell(cells, cell+run, compact) == value) {
+                        run++;
+                }
+                cell += run;
+
+                buffer[buffered++] = run;
+                buffer[buffered++] = (uint32_t)value;
+                if (buffered == 2*1024 || cell == count) {
+                        if (!write_all(fd, buffer, buffered*sizeof(uint32_t))) {
+                                return false;
+                        }
+                        *payload_size += buffered*sizeof(uint32_t);
+                        buffered = 0;
+                }
+        }
+        return true;
+}
+
+/*
+ * Write the checkpoint to a temporary file and move it into place, so
+ * that being stopped halfway through leaves the previous one intact.
+ */
+static bool write_checkpoint(const char *path, bool rle, struct checkpoint_header *header,
+                             const void *cells) {
+        size_t length = strlen(path);
+        char *tmp_path = malloc(length + sizeof(".tmp"));
+        must_init(tmp_path != NULL, "checkpoint path");
+        memcpy(tmp_path, path, length);
+        memcpy(tmp_path + length, ".tmp", sizeof(".tmp"));
+
+        bool ok = false;
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+                header->encoding = rle ? CHECKPOINT_RLE : CHECKPOINT_RAW;
+                header->payload_size = (uint64_t)header->dimension*header->dimension*header->cell_size;
+                ok = write_all(fd, header, sizeof(*header));
+                if (ok && rle) {
+                        // The payload size is only known at the end
+                        ok = write_rle(fd, header, cells, &header->payload_size) &&
+                             pwrite(fd, header, sizeof(*header), 0) == sizeof(*header);
+                } else if (ok) {
+                        ok = write_all(fd, cells, header->payload_size);
+                }
+                ok = fsync(fd) == 0 && ok;
+                ok = close(fd) == 0 && ok;
+                ok = ok && rename(tmp_path, path) == 0;
+        }
+
+        if (!ok) {
+                fprintf(stderr, "couldn't write checkpoint %s: %s\n", path, strerror(errno));
+                unlink(tmp_path);
+        }
+        free(tmp_path);
+        return ok;
+}
+
+static void *checkpoint_writer_main(void *arg) {
+        struct checkpoint_writer *writer = arg;
+
+        pthread_mutex_lock(&writer->lock);
+        for (;;) {
+                if (writer->busy) {
+                        // The header and cells belong to this thread while busy
+                        pthread_mutex_unlock(&writer->lock);
+                        write_checkpoint(writer->path, writer->rle, &writer->header, writer->cells);
+                        pthread_mutex_lock(&writer->lock);
+                        writer->busy = false;
+                        pthread_cond_broadcast(&writer->wake);
+                } else if (writer->quit) {
+                        break;
+                } else {
+                        pthread_cond_wait(&writer->wake, &writer->lock);
+                }
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        return NULL;
+}
+
+/*
+ * Copy the current grid for the writer thread, which must be idle.
+ */
+static void submit_checkpoint(struct checkpoint_writer *writer, struct simulation *simulation) {
+        const struct settings *settings = simulation->settings;
+        int dim = simulation->dimension;
+
+        sync_grid(simulation);
+        size_t row_size = grid_cell_size(simulation) * dim;
+
+        for (int i=0; i<dim; i++) {
+                memcpy((char *)writer->cells + i*row_size,
+                       (const char *)simulation->state + grid_index(dim, i, 0)*grid_cell_size(simulation),
+                       row_size);
+        }
+
+        struct checkpoint_header *header = &writer->header;
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+        header->version = CHECKPOINT_VERSION;
+        header->cell_size = grid_cell_size(simulation);
+        header->dimension = dim;
+        header->max_infected_value = settings->max_infected_value;
+        header->rng_seed = settings->rng_seed;
+        header->lethality = settings->lethality;
+        header->infectiousness = settings->infectiousness;
+        header->immunization_chance = settings->immunization_chance;
+        header->step = simulation->step;
+
+        pthread_mutex_lock(&writer->lock);
+        writer->busy = true;
+        writer->written_step = simulation->step;
+        if (writer->every > 0) {
+                writer->next_step = simulation->step + writer->every;
+        }
+        pthread_cond_broadcast(&writer->wake);
+        pthread_mutex_unlock(&writer->lock);
+}
+
+static void start_checkpoint_writer(struct settings *settings, const struct simulation *simulation,
+                                    struct checkpoint_writer *writer) {
+        writer->path = settings->checkpoint_path;
+        if (writer->path == NULL) {
+                return;
+        }
+
+        writer->every = settings->checkpoint_every;
+        writer->rle = settings->checkpoint_rle;
+        writer->cells = malloc(grid_cell_size(simulation) * simulation->dimension * simulation->dimension);
+        must_init(writer->cells != NULL, "checkpoint buffer");
+        writer->busy = false;
+        writer->quit = false;
+        writer->written_step = simulation->step;
+        writer->next_step = writer->every > 0 ? simulation->step + writer->every : UINT64_MAX;
+
+        must_init(pthread_mutex_init(&writer->lock, NULL) == 0, "checkpoint lock");
+        must_init(pthread_cond_init(&writer->wake, NULL) == 0, "checkpoint condition");
+        must_init(pthread_create(&writer->thread, NULL, checkpoint_writer_main, writer) == 0,
+                  "checkpoint thread");
+}
+
+/*
+ * Called after every step to hand a checkpoint to the writer thread if
+ * one is due and it's free to take it.
+ */
+static void checkpoint_step(struct checkpoint_writer *writer, struct simulation *simulation) {
+        if (writer->path == NULL || simulation->step < writer->next_step) {
+                return;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        bool busy = writer->busy;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (!busy) {
+                uint64_t start = profile_begin();
+                submit_checkpoint(writer, simulation);
+                profile_end(PROFILE_CHECKPOINT, start);
+        }
+}
+
+/*
+ * Write a last checkpoint of where the simulation was left, unless
+ * that's already the latest one, and wait for it to be written.
+ */
+static void stop_checkpoint_writer(struct checkpoint_writer *writer, struct simulation *simulation) {
+        if (writer->path == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        while (writer->busy) {
+                pthread_cond_wait(&writer->wake, &writer->lock);
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        if (writer->written_step != simulation->step || simulation->step == 0) {
+                submit_checkpoint(writer, simulation);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->quit = true;
+        pthread_cond_broadcast(&writer->wake);
+        pthread_mutex_unlock(&writer->lock);
+
+        pthread_join(writer->thread, NULL);
+        pthread_cond_destroy(&writer->wake);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer->cells);
+}
+
+
+////////////////////////////
+/////[OUTPUT FUNCTIONS]/////
+////////////////////////////
+
+static void write_csv_header(FILE *file, bool transitions) {
+        fputs("step,healthy,infected,cured,dead", file);
+        fputs(transitions ? ",infections,deaths,cures\n" : "\n", file);
+}
+
+static void write_csv_row(FILE *file, const struct output_row *row, bool transitions) {
+        fprintf(file, "%" PRIu64 ",%ld,%ld,%ld,%ld", row->step,
+                row->tally.healthy, row->tally.infected, row->tally.cured, row->tally.dead);
+        if (transitions) {
+                fprintf(file, ",%ld,%ld,%ld", row->transitions.infections,
+                        row->transitions.deaths, row->transitions.cures);
+        }
+        fputc('\n', file);
+}
+
+static void write_binary_header(FILE *file, bool transitions) {
+        uint32_t fields[2] = {OUTPUT_VERSION, transitions ? 8 : 5};
+        fwrite(OUTPUT_MAGIC, 1, 8, file);
+        fwrite(fields, sizeof(fields), 1, file);
+}
+
+static void write_binary_row(FILE *file, const struct output_row *row, bool transitions) {
+        int64_t columns[8] = {
+                row->step, row->tally.healthy, row->tally.infected, row->tally.cured, row->tally.dead,
+                row->transitions.infections, row->transitions.deaths, row->transitions.cures,
+        };
+        fwrite(columns, sizeof(int64_t), transitions ? 8 : 5, file);
+}
+
+static const struct output_format_ops output_formats[] = {
+        [OUTPUT_CSV] = {write_csv_header, write_csv_row},
+        [OUTPUT_BINARY] = {write_binary_header, write_binary_row},
+};
+
+static void *output_thread_main(void *arg) {
+        struct output_sink *sink = arg;
+
+        pthread_mutex_lock(&sink->lock);
+        for (;;) {
+                if (sink->pending > 0) {
+                        // The writing block belongs to this thread while pending
+                        pthread_mutex_unlock(&sink->lock);
+                        for (int i=0; i<sink->pending; i++) {
+                                sink->ops->write_row(sink->file, &sink->writing[i], sink->transitions);
+                        }
+                        pthread_mutex_lock(&sink->lock);
+                        sink->pending = 0;
+                        pthread_cond_broadcast(&sink->wake);
+                } else if (sink->quit) {
+                        break;
+                } else {
+                        pthread_cond_wait(&sink->wake, &sink->lock);
+                }
+        }
+        pthread_mutex_unlock(&sink->lock);
+
+        return NULL;
+}
+
+/*
+ * Hand the filled rows to the output thread once it's done with the
+ * previous ones.
+ */
+static void flush_output_block(struct output_sink *sink) {
+        pthread_mutex_lock(&sink->lock);
+        while (sink->pending > 0) {
+                pthread_cond_wait(&sink->wake, &sink->lock);
+        }
+        struct output_row *tmp = sink->writing;
+        sink->writing = sink->filling;
+        sink->filling = tmp;
+        sink->pending = sink->filled;
+        sink->filled = 0;
+        pthread_cond_broadcast(&sink->wake);
+        pthread_mutex_unlock(&sink->lock);
+}
+
+static void output_row(struct output_sink *sink, const struct output_row *row) {
+        if (sink->file == NULL) {
+                return;
+        }
+
+        sink->filling[sink->filled++] = *row;
+        if (sink->filled == OUTPUT_BLOCK_ROWS) {
+                uint64_t start = profile_begin();
+                flush_output_block(sink);
+                profile_end(PROFILE_OUTPUT, start);
+        }
+}
+
+/*
+ * Record the current step of the simulation.
+ */
+static void output_step(struct output_sink *sink, const struct simulation *simulation) {
+        struct output_row row = {
+                .step = simulation->step,
+                .tally = simulation->tally,
+                .transitions = simulation->transitions,
+        };
+        output_row(sink, &row);
+}
+
+/*
+ * Open the output file if there is one. Steps are then recorded
+ * starting from the one the simulation starts at.
+ */
+static void start_output_sink(struct settings *settings, struct output_sink *sink) {
+        sink->file = NULL;
+        sink->path = settings->output_path;
+        if (sink->path == NULL) {
+                return;
+        }
+
+        sink->file = fopen(sink->path, settings->output_format == OUTPUT_BINARY ? "wb" : "w");
+        if (sink->file == NULL) {
+                fprintf(stderr, "couldn't open output %s: %s\n", sink->path, strerror(errno));
+                exit(1);
+        }
+        setvbuf(sink->file, NULL, _IOFBF, 1<<16);
+
+        sink->ops = &output_formats[settings->output_format];
+        sink->transitions = settings->output_transitions;
+        sink->filling = malloc(sizeof(struct output_row) * OUTPUT_BLOCK_ROWS);
+        sink->writing = malloc(sizeof(struct output_row) * OUTPUT_BLOCK_ROWS);
+        must_init(sink->filling != NULL && sink->writing != NULL, "output buffers");
+        sink->filled = 0;
+        sink->pending = 0;
+        sink->quit = false;
+
+        sink->ops->write_header(sink->file, sink->transitions);
+
+        must_init(pthread_mutex_init(&sink->lock, NULL) == 0, "output lock");
+        must_init(pthread_cond_init(&sink->wake, NULL) == 0, "output condition");
+        must_init(pthread_create(&sink->thread, NULL, output_thread_main, sink) == 0,
+                  "output thread");
+}
+
+/*
+ * Write out the remaining rows and close the file. Returns false if
+ * anything failed to be written.
+ */
+static bool stop_output_sink(struct output_sink *sink) {
+        if (sink->file == NULL) {
+                return true;
+        }
+
+        flush_output_block(sink);
+
+        pthread_mutex_lock(&sink->lock);
+        sink->quit = true;
+        pthread_cond_broadcast(&sink->wake);
+        pthread_mutex_unlock(&sink->lock);
+        pthread_join(sink->thread, NULL);
+
+        bool ok = !ferror(sink->file);
+        ok = fclose(sink->file) == 0 && ok;
+        if (!ok) {
+                fprintf(stderr, "couldn't write output %s\n", sink->path);
+        }
+
+        pthread_cond_destroy(&sink->wake);
+        pthread_mutex_destroy(&sink->lock);
+        free(sink->filling);
+        free(sink->writing);
+        return ok;
+}
+
+
+//////////////////////////////
+/////[HEADLESS FUNCTIONS]/////
+//////////////////////////////
+
+/*
+ * Run the simulation as fast as possible, printing the tallies of
+ * every step, until either the step limit is reached or there are no
+ * infected individuals left.
+ */
+static int run_headless(struct settings *settings) {
+#ifdef PROFILE
+        static struct profile_ring ring;
+        init_profile_ring(&ring, 1, "simulation");
+        start_profile_ring(&ring);
+        struct profile_trace trace;
+        start_trace(settings, &trace);
+#endif
+
+        struct simulation simulation;
+        create_simulation(settings, &simulation);
+        start_simulation(settings, &simulation);
+
+        struct checkpoint_writer checkpoints;
+        start_checkpoint_writer(settings, &simulation, &checkpoints);
+        struct output_sink output;
+        start_output_sink(settings, &output);
+        output_step(&output, &simulation);
+
+        printf("step healthy infected cured dead\n");
+        for (;;) {
+                const struct tally *tally = &simulation.tally;
+                printf("%" PRIu64 " %ld %ld %ld %ld\n", simulation.step,
+                       tally->healthy, tally->infected, tally->cured, tally->dead);
+
+                if (tally->infected == 0 ||
+                    (settings->headless_steps > 0 && simulation.step >= (uint64_t)settings->headless_steps)) {
+                        break;
+                }
+
+                simulation_step(settings, &simulation);
+                checkpoint_step(&checkpoints, &simulation);
+                output_step(&output, &simulation);
+#ifdef PROFILE
+                drain_trace(&trace, &ring, false);
+#endif
+        }
+
+        bool ok = stop_output_sink(&output);
+        stop_checkpoint_writer(&checkpoints, &simulation);
+        destroy_simulation(&simulation);
+#ifdef PROFILE
+        ok = stop_trace(&trace, &ring) && ok;
+        stop_profile_ring();
+#endif
+        return ok ? 0 : 1;
+}
+
+
+///////////////////////////////////
+/////[MULTI-PROCESS FUNCTIONS]/////
+///////////////////////////////////
+
+static char *exchange_row(const struct strip_exchange *exchange, uint64_t step, int proc, bool last) {
+        size_t slot = ((step % 2) * exchange->procs + proc) * 2 + last;
+        return exchange->rows + slot * exchange->row_size;
+}
+
+/*
+ * Step the strip of rows of one process. The grid is allocated whole
+ * but only the strip and the rows next to it are ever touched, so the
+ * rest of it never takes up memory.
+ */
+static int run_strip(struct settings *settings, struct strip_exchange *exchange, int proc) {
+        int procs = exchange->procs;
+        int dim = settings->simulation_grid_dimension;
+        int first_row = (int)((long)dim * proc / procs);
+        int end_row = (int)((long)dim * (proc+1) / procs);
+        size_t row_size = exchange->row_size;
+
+        struct simulation simulation;
+        create_simulation(settings, &simulation);
+        size_t cell_size = grid_cell_size(&simulation);
+        for (int i=0; i<simulation.threads; i++) {
+                simulation.bands[i].first_row = first_row + (int)((long)(end_row - first_row) * i / simulation.threads);
+                simulation.bands[i].end_row = first_row + (int)((long)(end_row - first_row) * (i+1) / simulation.threads);
+        }
+
+        int mid = dim/2;
+        if (mid >= first_row && mid < end_row) {
+                store_cell(simulation.state, grid_index(dim, mid, mid), 1, simulation.compact);
+        }
+        tally_rows(&simulation, first_row, end_row, &simulation.tally);
+        simulation.transitions = (struct transitions){0, 0, 0};
+
+        struct output_sink output = {.file = NULL};
+        if (proc == 0) {
+                start_output_sink(settings, &output);
+                printf("step healthy infected cured dead\n");
+        }
+
+        for (;;) {
+                uint64_t step = simulation.step;
+                memcpy(exchange_row(exchange, step, proc, false),
+                       (char *)simulation.state + grid_index(dim, first_row, 0)*cell_size, row_size);
+                memcpy(exchange_row(exchange, step, proc, true),
+                       (char *)simulation.state + grid_index(dim, end_row-1, 0)*cell_size, row_size);
+                exchange->tallies[(step % 2) * procs + proc] = simulation.tally;
+                exchange->transitions[(step % 2) * procs + proc] = simulation.transitions;
+
+                pthread_barrier_wait(&exchange->barrier);
+
+                if (proc > 0) {
+                        memcpy((char *)simulation.state + grid_index(dim, first_row-1, 0)*cell_size,
+                               exchange_row(exchange, step, proc-1, true), row_size);
+                }
+                if (proc < procs-1) {
+                        memcpy((char *)simulation.state + grid_index(dim, end_row, 0)*cell_size,
+                               exchange_row(exchange, step, proc+1, false), row_size);
+                }
+
+                // Every process adds up the same tally, and so stops at the same step
+                struct output_row row = {.step = step};
+                for (int p=0; p<procs; p++) {
+                        const struct tally *tally = &exchange->tallies[(step % 2) * procs + p];
+                        const struct transitions *transitions = &exchange->transitions[(step % 2) * procs + p];
+                        row.tally.healthy += tally->healthy;
+                        row.tally.infected += tally->infected;
+                        row.tally.cured += tally->cured;
+                        row.tally.dead += tally->dead;
+                        row.transitions.infections += transitions->infections;
+                        row.transitions.deaths += transitions->deaths;
+                        row.transitions.cures += transitions->cures;
+                }
+
+                if (proc == 0) {
+                        printf("%" PRIu64 " %ld %ld %ld %ld\n", step, row.tally.healthy,
+                               row.tally.infected, row.tally.cured, row.tally.dead);
+                        output_row(&output, &row);
+                }
+
+                if (row.tally.infected == 0 ||
+                    (settings->headless_steps > 0 && step >= (uint64_t)settings->headless_steps)) {
+                        break;
+                }
+
+                simulation_step(settings, &simulation);
+        }
+
+        bool ok = stop_output_sink(&output);
+        destroy_simulation(&simulation);
+        return ok ? 0 : 1;
+}
+
+/*
+ * Run the simulation headless, split into strips stepped by separate
+ * processes. They wait for each other once per step, after publishing
+ * the rows their neighbours need, and all of them add up the tally.
+ * The random draws of a cell don't depend on who steps it, so neither
+ * do the results. Every strip gets a child process, leaving this one
+ * to watch them: one that dies would leave the others waiting for it
+ * at the barrier forever, so they are all killed and the run fails.
+ */
+static int run_processes(struct settings *settings) {
+        int dim = settings->simulation_grid_dimension;
+        int procs = MIN(settings->procs, dim);
+        size_t cell_size = settings->max_infected_value <= COMPACT_MAX_INFECTED_VALUE ? sizeof(int8_t) : sizeof(int);
+        size_t row_size = cell_size * dim;
+
+        size_t tallies_size = sizeof(struct tally) * 2 * procs;
+        size_t transitions_size = sizeof(struct transitions) * 2 * procs;
+        size_t size = sizeof(struct strip_exchange) + tallies_size + transitions_size + row_size * 2 * procs * 2;
+        char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        must_init(shared != MAP_FAILED, "shared memory");
+
+        struct strip_exchange *exchange = (struct strip_exchange *)shared;
+        exchange->procs = procs;
+        exchange->row_size = row_size;
+        exchange->tallies = (struct tally *)(shared + sizeof(struct strip_exchange));
+        exchange->transitions = (struct transitions *)(shared + sizeof(struct strip_exchange) + tallies_size);
+        exchange->rows = shared + sizeof(struct strip_exchange) + tallies_size + transitions_size;
+
+        pthread_barrierattr_t attr;
+        pthread_barrierattr_init(&attr);
+        pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        must_init(pthread_barrier_init(&exchange->barrier, &attr, procs) == 0, "process barrier");
+        pthread_barrierattr_destroy(&attr);
+
+        // Don't let children inherit anything buffered
+        fflush(stdout);
+        pid_t *children = malloc(sizeof(pid_t) * procs);
+        must_init(children != NULL, "process ids");
+        int status = 0;
+        int running = 0;
+        for (; running<procs; running++) {
+                pid_t pid = fork();
+                if (pid < 0) {
+                        perror("fork");
+                        status = 1;
+                        break;
+                } else if (pid == 0) {
+                        int strip_status = run_strip(settings, exchange, running);
+                        fflush(stdout);
+                        _exit(strip_status);
+                }
+                children[running] = pid;
+        }
+
+        int started = running;
+        bool killed = status != 0;
+        if (killed) {
+                for (int p=0; p<started; p++) {
+                        kill(children[p], SIGKILL);
+                }
+        }
+        while (running > 0) {
+                int child_status;
+                pid_t pid = waitpid(-1, &child_status, 0);
+                if (pid < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        status = 1;
+                        break;
+                }
+
+                int proc = 0;
+                while (proc < started && children[proc] != pid) {
+                        proc++;
+                }
+                if (proc == started) {
+                        continue;
+                }
+                children[proc] = 0;
+                running--;
+
+                if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+                        status = 1;
+                        if (!killed) {
+                                fprintf(stderr, "process for strip %d failed, stopping the others\n", proc);
+                                for (int p=0; p<started; p++) {
+                                        if (children[p] != 0) {
+                                                kill(children[p], SIGKILL);
+                                        }
+                                }
+                                killed = true;
+                        }
+                }
+        }
+
+        free(children);
+        // Destroying waits for processes still in the barrier, which killed ones never leave
+        if (!killed) {
+                pthread_barrier_destroy(&exchange->barrier);
+        }
+        munmap(shared, size);
+        return status;
+}
+
+
+/////////////////////////////
+/////[NETWORK FUNCTIONS]/////
+/////////////////////////////
+
+static bool isdigit_char(char c) {
+        return c >= '0' && c <= '9';
+}
+
+/*
+ * Read the edges of an edge list as pairs of node numbers, and how
+ * many nodes there are: one more than the largest number.
+ */
+static bool parse_edge_list(const char *path, const char *text, size_t size,
+                            uint32_t **edges, size_t *edge_count, uint32_t *nodes) {
+        size_t capacity = 1 << 16, count = 0;
+        uint32_t *list = malloc(sizeof(uint32_t) * 2 * capacity);
+        must_init(list != NULL, "edge list");
+        uint32_t max_node = 0;
+
+        const char *p = text, *end = text + size;
+        for (long line=1; p<end; line++) {
+                const char *eol = memchr(p, '\n', end - p);
+                if (eol == NULL) {
+                        eol = end;
+                }
+                while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                        p++;
+                }
+
+                if (p < eol && *p != '#' && *p != '%') {
+                        uint32_t ends[2];
+                        for (int k=0; k<2; k++) {
+                                while (p < eol && (*p == ' ' || *p == '\t' || *p == ',')) {
+                                        p++;
+                                }
+                                if (p == eol || !isdigit_char(*p)) {
+                                        fprintf(stderr, "%s:%ld: expected two node numbers\n", path, line);
+                                        free(list);
+                                        return false;
+                                }
+                                uint64_t value = 0;
+                                while (p < eol && isdigit_char(*p)) {
+                                        value = value * 10 + (uint64_t)(*p++ - '0');
+                                        if (value >= UINT32_MAX) {
+                                                fprintf(stderr, "%s:%ld: node number too large\n", path, line);
+                                                free(list);
+                                                return false;
+                                        }
+                                }
+                                ends[k] = (uint32_t)value;
+                        }
+
+                        if (count == capacity) {
+                                capacity *= 2;
+                                list = realloc(list, sizeof(uint32_t) * 2 * capacity);
+                                must_init(list != NULL, "edge list");
+                        }
+                        list[2*count] = ends[0];
+                        list[2*count+1] = ends[1];
+                        count++;
+                        max_node = MAX(max_node, MAX(ends[0], ends[1]));
+                }
+                p = eol + 1;
+        }
+
+        if (count == 0) {
+                fprintf(stderr, "%s: no edges\n", path);
+                free(list);
+                return false;
+        }
+        *edges = list;
+        *edge_count = count;
+        *nodes = max_node + 1;
+        return true;
+}
+
+/*
+ * Turn a list of edges into compressed sparse rows, leaving out edges
+ * from a node to itself.
+ */
+static void build_network(const uint32_t *edges, size_t edge_count, uint32_t nodes,
+                          struct network *network) {
+        uint64_t *offsets = calloc((size_t)nodes + 1, sizeof(uint64_t));
+        must_init(offsets != NULL, "network offsets");
+        for (size_t i=0; i<edge_count; i++) {
+                if (edges[2*i] != edges[2*i+1]) {
+                        offsets[edges[2*i] + 1]++;
+                        offsets[edges[2*i+1] + 1]++;
+                }
+        }
+        for (uint32_t node=0; node<nodes; node++) {
+                offsets[node + 1] += offsets[node];
+        }
+
+        uint64_t entries = offsets[nodes];
+        uint32_t *neighbours = malloc(sizeof(uint32_t) * MAX(entries, 1));
+        uint64_t *next = malloc(sizeof(uint64_t) * nodes);
+        must_init(neighbours != NULL && next != NULL, "network neighbours");
+        memcpy(next, offsets, sizeof(uint64_t) * nodes);
+        for (size_t i=0; i<edge_count; i++) {
+                uint32_t a = edges[2*i], b = edges[2*i+1];
+                if (a != b) {
+                        neighbours[next[a]++] = b;
+                        neighbours[next[b]++] = a;
+                }
+        }
+        free(next);
+
+        network->nodes = nodes;
+        network->entries = entries;
+        network->offsets = network->owned_offsets = offsets;
+        network->neighbours = network->owned_neighbours = neighbours;
+        network->mapping = NULL;
+        network->mapping_size = 0;
+}
+
+static void network_header_for(const struct stat *source, struct network_header *header) {
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, NETWORK_MAGIC, sizeof(header->magic));
+        header->version = NETWORK_VERSION;
+        header->source_size = source->st_size;
+        header->source_seconds = source->st_mtim.tv_sec;
+        header->source_nanoseconds = source->st_mtim.tv_nsec;
+}
+
+/*
+ * Map a cached network, if there is one built from the edge list as it
+ * is now. A cache that doesn't check out is ignored, and rebuilt.
+ */
+static bool open_network_cache(const char *cache_path, const struct stat *source,
+                               struct network *network) {
+        int fd = open(cache_path, O_RDONLY);
+        if (fd < 0) {
+                return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct network_header)) {
+                close(fd);
+                return false;
+        }
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+                return false;
+        }
+
+        const struct network_header *header = mapping;
+        struct network_header expected;
+        network_header_for(source, &expected);
+        bool ok = memcmp(header->magic, expected.magic, sizeof(header->magic)) == 0 &&
+                header->version == expected.version &&
+                header->source_size == expected.source_size &&
+                header->source_seconds == expected.source_seconds &&
+                header->source_nanoseconds == expected.source_nanoseconds &&
+                header->nodes > 0 &&
+                (uint64_t)st.st_size == sizeof(*header) + sizeof(uint64_t) * ((uint64_t)header->nodes + 1) +
+                                        sizeof(uint32_t) * header->entries;
+
+        const uint64_t *offsets = (const uint64_t *)(header + 1);
+        const uint32_t *neighbours = (const uint32_t *)(offsets + header->nodes + 1);
+        if (ok) {
+                ok = offsets[0] == 0 && offsets[header->nodes] == header->entries;
+                for (uint32_t node=0; ok && node<header->nodes; node++) {
+                        ok = offsets[node] <= offsets[node + 1];
+                }
+                for (uint64_t i=0; ok && i<header->entries; i++) {
+                        ok = neighbours[i] < header->nodes;
+                }
+        }
+        if (!ok) {
+                munmap(mapping, st.st_size);
+                return false;
+        }
+
+        network->nodes = header->nodes;
+        network->entries = header->entries;
+        network->offsets = offsets;
+        network->neighbours = neighbours;
+        network->mapping = mapping;
+        network->mapping_size = st.st_size;
+        network->owned_offsets = NULL;
+        network->owned_neighbours = NULL;
+        return true;
+}
+
+static bool write_network_cache(const char *cache_path, const struct stat *source,
+                                const struct network *network) {
+        struct network_header header;
+        network_header_for(source, &header);
+        header.nodes = network->nodes;
+        header.entries = network->entries;
+
+        size_t length = strlen(cache_path);
+        char *tmp_path = malloc(length + sizeof(".tmp"));
+        must_init(tmp_path != NULL, "network cache path");
+        memcpy(tmp_path, cache_path, length);
+        memcpy(tmp_path + length, ".tmp", sizeof(".tmp"));
+
+        bool ok = false;
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+                ok = write_all(fd, &header, sizeof(header)) &&
+                     write_all(fd, network->offsets, sizeof(uint64_t) * ((size_t)network->nodes + 1)) &&
+                     write_all(fd, network->neighbours, sizeof(uint32_t) * network->entries);
+                ok = close(fd) == 0 && ok;
+                ok = ok && rename(tmp_path, cache_path) == 0;
+        }
+
+        if (!ok) {
+                fprintf(stderr, "couldn't cache network in %s: %s\n", cache_path, strerror(errno));
+                unlink(tmp_path);
+        }
+        free(tmp_path);
+        return ok;
+}
+
+/*
+ * Load a network from its cache, or otherwise from its edge list,
+ * caching it for next time. Failing to write the cache isn't an error.
+ */
+static bool load_network(const char *path, struct network *network) {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+                fprintf(stderr, "couldn't open network %s: %s\n", path, strerror(errno));
+                return false;
+        }
+
+        size_t length = strlen(path);
+        char *cache_path = malloc(length + sizeof(".csr"));
+        must_init(cache_path != NULL, "network cache path");
+        memcpy(cache_path, path, length);
+        memcpy(cache_path + length, ".csr", sizeof(".csr"));
+
+        if (open_network_cache(cache_path, &st, network)) {
+                free(cache_path);
+                return true;
+        }
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "couldn't open network %s: %s\n", path, strerror(errno));
+                free(cache_path);
+                return false;
+        }
+        void *text = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        close(fd);
+        if (text == MAP_FAILED) {
+                fprintf(stderr, "couldn't map network %s: %s\n", path, strerror(errno));
+                free(cache_path);
+                return false;
+        }
+
+        uint32_t *edges;
+        size_t edge_count;
+        uint32_t nodes;
+        bool ok = parse_edge_list(path, text, st.st_size, &edges, &edge_count, &nodes);
+        if (text != NULL) {
+                munmap(text, st.st_size);
+        }
+        if (ok) {
+                build_network(edges, edge_count, nodes, network);
+                free(edges);
+                write_network_cache(cache_path, &st, network);
+        }
+        free(cache_path);
+        return ok;
+}
+
+static void close_network(struct network *network) {
+        if (network->mapping != NULL) {
+                munmap(network->mapping, network->mapping_size);
+        }
+        free(network->owned_offsets);
+        free(network->owned_neighbours);
+}
+
+/*
+ * The first node of band i of n, such that bands have about as many
+ * nodes plus edges each.
+ */
+static uint32_t band_first_node(const struct network *network, int i, int n) {
+        uint64_t total = network->entries + network->nodes;
+        uint64_t target = total / n * i + total % n * i / n;
+        uint32_t low = 0, high = network->nodes;
+        while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                if (network->offsets[mid] + mid < target) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+        return low;
+}
+
+static void *network_worker(void *arg);
+
+static void create_network_simulation(struct settings *settings, const struct network *network,
+                                      uint32_t patient_zero, struct network_simulation *simulation) {
+        simulation->network = network;
+        simulation->settings = settings;
+        simulation->compact = settings->max_infected_value <= COMPACT_MAX_INFECTED_VALUE;
+
+        size_t cell_size = simulation->compact ? sizeof(int8_t) : sizeof(int);
+        simulation->state = alloc_grid(cell_size * network->nodes);
+        simulation->next_state = alloc_grid(cell_size * network->nodes);
+        must_init(simulation->state != NULL && simulation->next_state != NULL, "network state");
+        store_cell(simulation->state, patient_zero, 1, simulation->compact);
+
+        simulation->step = 0;
+        simulation->tally = (struct tally){network->nodes - 1, 1, 0, 0};
+        simulation->transitions = (struct transitions){0, 0, 0};
+
+        int threads = (int)MAX(1, MIN((uint32_t)settings->threads, network->nodes));
+        simulation->threads = threads;
+        simulation->quit = false;
+        simulation->bands = malloc(sizeof(struct network_band) * threads);
+        must_init(simulation->bands != NULL, "network bands");
+        for (int i=0; i<threads; i++) {
+                simulation->bands[i].simulation = simulation;
+                simulation->bands[i].first_node = band_first_node(network, i, threads);
+                simulation->bands[i].end_node = i+1 < threads ? band_first_node(network, i+1, threads)
+                                                              : network->nodes;
+        }
+
+        if (threads > 1) {
+                must_init(pthread_barrier_init(&simulation->step_start, NULL, threads) == 0,
+                          "step barrier");
+                must_init(pthread_barrier_init(&simulation->step_done, NULL, threads) == 0,
+                          "step barrier");
+                for (int i=1; i<threads; i++) {
+                        must_init(pthread_create(&simulation->bands[i].thread, NULL,
+                                                 network_worker, &simulation->bands[i]) == 0,
+                                  "step thread");
+                }
+        }
+}
+
+static void destroy_network_simulation(struct network_simulation *simulation) {
+        if (simulation->threads > 1) {
+                simulation->quit = true;
+                pthread_barrier_wait(&simulation->step_start);
+                for (int i=1; i<simulation->threads; i++) {
+                        pthread_join(simulation->bands[i].thread, NULL);
+                }
+                pthread_barrier_destroy(&simulation->step_start);
+                pthread_barrier_destroy(&simulation->step_done);
+        }
+        free(simulation->bands);
+
+        size_t cell_size = simulation->compact ? sizeof(int8_t) : sizeof(int);
+        free_grid(simulation->state, cell_size * simulation->network->nodes);
+        free_grid(simulation->next_state, cell_size * simulation->network->nodes);
+}
+
+/*
+ * The same rules as advance_state, with a node's neighbours being the
+ * ones it has in the network.
+ */
+static ALWAYS_INLINE void step_nodes(struct network_simulation *simulation, struct network_band *band,
+                                     bool compact, int kernel) {
+        int max_infected_value = simulation->settings->max_infected_value;
+        const uint64_t *offsets = simulation->network->offsets;
+        const uint32_t *neighbours = simulation->network->neighbours;
+        const void *current = simulation->state;
+        void *next = simulation->next_state;
+
+        for (uint32_t node=band->first_node; node<band->end_node; node++) {
+                int cell = load_cell(current, node, compact);
+                int next_cell = cell;
+                if (cell > 0) {
+                        next_cell = advance_infected(cell, max_infected_value, &simulation->rng,
+                                                     &simulation->chances, &band->transitions, node,
+                                                     kernel);
+                } else if (cell == 0) {
+                        for (uint64_t i=offsets[node]; i<offsets[node + 1]; i++) {
+                                if (load_cell(current, neighbours[i], compact) > 0) {
+                                        if (chance(simulation->chances.infectiousness,
+                                                   rng_draw(&simulation->rng, node, 0))) {
+                                                next_cell = 1;
+                                                band->transitions.infections++;
+                                        }
+                                        break;
+                                }
+                        }
+                }
+                store_cell(next, node, next_cell, compact);
+        }
+}
+
+static ALWAYS_INLINE void step_network_kernel(struct network_band *band, int kernel) {
+        if (band->simulation->compact) {
+                step_nodes(band->simulation, band, true, kernel);
+        } else {
+                step_nodes(band->simulation, band, false, kernel);
+        }
+}
+
+static void step_network_band(struct network_band *band) {
+        band->transitions = (struct transitions){0, 0, 0};
+        switch (band->simulation->kernel) {
+        case KERNEL_NO_DEATHS:
+                step_network_kernel(band, KERNEL_NO_DEATHS);
+                break;
+        case KERNEL_SURE_CURE:
+                step_network_kernel(band, KERNEL_SURE_CURE);
+                break;
+        case KERNEL_NO_DEATHS | KERNEL_SURE_CURE:
+                step_network_kernel(band, KERNEL_NO_DEATHS | KERNEL_SURE_CURE);
+                break;
+        default:
+                step_network_kernel(band, 0);
+                break;
+        }
+}
+
+static void *network_worker(void *arg) {
+        struct network_band *band = arg;
+        struct network_simulation *simulation = band->simulation;
+
+        for (;;) {
+                pthread_barrier_wait(&simulation->step_start);
+                if (simulation->quit) {
+                        break;
+                }
+                step_network_band(band);
+                pthread_barrier_wait(&simulation->step_done);
+        }
+
+        return NULL;
+}
+
+static void network_step(struct network_simulation *simulation) {
+        uint64_t start = profile_begin();
+        simulation->rng = rng_for_step(simulation->settings->rng_seed, simulation->step);
+        simulation->chances = chances_for(simulation->settings);
+        simulation->kernel = kernel_for(&simulation->chances);
+
+        if (simulation->threads > 1) {
+                pthread_barrier_wait(&simulation->step_start);
+                step_network_band(&simulation->bands[0]);
+                pthread_barrier_wait(&simulation->step_done);
+        } else {
+                step_network_band(&simulation->bands[0]);
+        }
+
+        simulation->transitions = (struct transitions){0, 0, 0};
+        for (int i=0; i<simulation->threads; i++) {
+                const struct transitions *transitions = &simulation->bands[i].transitions;
+                apply_transitions(&simulation->tally, transitions);
+                simulation->transitions.infections += transitions->infections;
+                simulation->transitions.deaths += transitions->deaths;
+                simulation->transitions.cures += transitions->cures;
+        }
+
+        simulation->step++;
+        void *tmp = simulation->state;
+        simulation->state = simulation->next_state;
+        simulation->next_state = tmp;
+        profile_end(PROFILE_STEP, start);
+}
+
+/*
+ * Run the simulation over a contact network as fast as possible,
+ * printing the tallies of every step like run_headless.
+ */
+static int run_network(struct settings *settings) {
+        struct network network;
+        if (!load_network(settings->network_path, &network)) {
+                return 1;
+        }
+        uint32_t patient_zero = settings->patient_zero >= 0 ? (uint32_t)settings->patient_zero
+                                                            : network.nodes / 2;
+        if (settings->patient_zero >= (long)network.nodes) {
+                fprintf(stderr, "patient zero %ld isn't in the network, which has %" PRIu32 " nodes\n",
+                        settings->patient_zero, network.nodes);
+                close_network(&network);
+                return 1;
+        }
+
+        struct network_simulation simulation;
+        create_network_simulation(settings, &network, patient_zero, &simulation);
+
+        struct output_sink output;
+        start_output_sink(settings, &output);
+
+        printf("step healthy infected cured dead\n");
+        for (;;) {
+                const struct tally *tally = &simulation.tally;
+                struct output_row row = {
+                        .step = simulation.step,
+                        .tally = *tally,
+                        .transitions = simulation.transitions,
+                };
+                output_row(&output, &row);
+                printf("%" PRIu64 " %ld %ld %ld %ld\n", simulation.step,
+                       tally->healthy, tally->infected, tally->cured, tally->dead);
+
+                if (tally->infected == 0 ||
+                    (settings->headless_steps > 0 && simulation.step >= (uint64_t)settings->headless_steps)) {
+                        break;
+                }
+
+                network_step(&simulation);
+        }
+
+        bool ok = stop_output_sink(&output);
+        destroy_network_simulation(&simulation);
+        close_network(&network);
+        return ok ? 0 : 1;
+}
+
+
+///////////////////////////////////////
+/////[SIMULATION THREAD FUNCTIONS]/////
+///////////////////////////////////////
+
+#ifndef NO_ALLEGRO
+/*
+ * How many levels of detail it takes to show a whole grid with no more
+ * than about two cells to a pixel.
+ */
+static int view_levels(int dim) {
+        int levels = 0;
+        while (levels < VIEW_MAX_LEVELS && ((long)DISPLAYY << (levels + 1)) <= dim) {
+                levels++;
+        }
+        return levels;
+}
+
+/*
+ * Keep track of which tiles each step leaves with an infected
+ * individual from now on. A tile can only change on a step that
+ * starts or ends with one in it.
+ */
+static void track_infected_tiles(struct simulation *simulation) {
+        int tiles = (simulation->dimension + TILE_SIZE - 1) / TILE_SIZE;
+        simulation->tile_infected = malloc(sizeof(bool) * tiles * tiles);
+        must_init(simulation->tile_infected != NULL, "tile flags");
+        memset(simulation->tile_infected, 0, sizeof(bool) * tiles * tiles);
+}
+
+/*
+ * Mark the tiles the last step may have changed as stale in every
+ * snapshot.
+ */
+static void mark_stale_tiles(struct simulation_thread *thread) {
+        const bool *infected = thread->simulation->tile_infected;
+        bool *last_infected = thread->last_infected_tiles;
+        int tiles = thread->snapshots[0].tiles;
+
+        for (int tile=0; tile<tiles*tiles; tile++) {
+                if (last_infected[tile] || infected[tile]) {
+                        for (int i=0; i<3; i++) {
+                                thread->snapshots[i].stale[tile] = true;
+                        }
+                }
+                last_infected[tile] = infected[tile];
+        }
+}
+
+/*
+ * Bring a snapshot up to date with the simulation. When it is kept by
+ * tile, only the stale tiles are copied, and the ones stale in the
+ * previous snapshot are the ones that differ from it.
+ */
+static void take_snapshot(struct simulation *simulation, struct snapshot *snapshot,
+                          const struct snapshot *previous) {
+        uint64_t start = profile_begin();
+        sync_grid(simulation);
+        if (snapshot->stale == NULL) {
+                memcpy(snapshot->cells, simulation->state,
+                       grid_cell_size(simulation) * grid_cells(simulation->dimension));
+        } else {
+                int dim = simulation->dimension;
+                int tiles = snapshot->tiles;
+                size_t size = grid_cell_size(simulation);
+                for (int tile=0; tile<tiles*tiles; tile++) {
+                        snapshot->dirty[tile] = previous == NULL || previous->stale[tile];
+                        if (!snapshot->stale[tile]) {
+                                continue;
+                        }
+
+                        int first_row = (tile / tiles) * TILE_SIZE;
+                        int first_col = (tile % tiles) * TILE_SIZE;
+                        size_t width = (size_t)MIN(TILE_SIZE, dim - first_col) * size;
+                        for (int x=first_row; x<MIN(dim, first_row + TILE_SIZE); x++) {
+                                size_t offset = grid_index(dim, x, first_col) * size;
+                                memcpy((char *)snapshot->cells + offset,
+                                       (const char *)simulation->state + offset, width);
+                        }
+                        snapshot->stale[tile] = false;
+                }
+        }
+        snapshot->tally = simulation->tally;
+        snapshot->step = simulation->step;
+        profile_end(PROFILE_SNAPSHOT, start);
+}
+
+static void reset_history(struct history *history) {
+        history->empty = true;
+        for (int level=0; level<HISTORY_LEVELS; level++) {
+                for (int i=0; i<HISTORY_BUCKETS; i++) {
+                        history->levels[level][i].index = UINT64_MAX;
+                }
+        }
+}
+
+/*
+ * Add the tally of a step to the bucket that takes it in at every
+ * level. Steps are recorded in order.
+ */
+static void record_history(struct history *history, uint64_t step, const struct tally *tally) {
+        long values[HISTORY_SERIES] = {tally->healthy, tally->infected, tally->cured, tally->dead};
+
+        if (history->empty) {
+                history->first_step = step;
+                history->empty = false;
+        }
+        history->last_step = step;
+
+        for (int level=0; level<HISTORY_LEVELS; level++) {
+                uint64_t index = step >> level;
+                struct history_bucket *bucket = &history->levels[level][index % HISTORY_BUCKETS];
+                if (bucket->index != index) {
+                        bucket->index = index;
+                        bucket->count = 0;
+                        for (int i=0; i<HISTORY_SERIES; i++) {
+                                bucket->min[i] = LONG_MAX;
+                                bucket->max[i] = LONG_MIN;
+                                bucket->sum[i] = 0;
+                        }
+                }
+
+                bucket->count++;
+                for (int i=0; i<HISTORY_SERIES; i++) {
+                        bucket->min[i] = MIN(bucket->min[i], values[i]);
+                        bucket->max[i] = MAX(bucket->max[i], values[i]);
+                        bucket->sum[i] += values[i];
+                }
+        }
+}
+
+static void timespec_add(struct timespec *time, double seconds) {
+        long nanoseconds = time->tv_nsec + (long)(seconds * 1e9);
+        time->tv_sec += nanoseconds / 1000000000L;
+        time->tv_nsec = nanoseconds % 1000000000L;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b) {
+        return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Step whenever a step is due: one every timestep seconds, or as fast
+ * as possible if it's 0, unless paused. In manual step mode, only as
+ * many steps as requested.
+ */
+static void *simulation_thread_main(void *arg) {
+        struct simulation_thread *thread = arg;
+        struct settings *settings = thread->settings;
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+#ifdef PROFILE
+        start_profile_ring(&thread->profile);
+#endif
+
+        pthread_mutex_lock(&thread->lock);
+        for (;;) {
+                if (thread->quit) {
+                        break;
+                }
+
+                if (settings->step_at_a_time ? thread->requested_steps == 0 : thread->paused) {
+                        pthread_cond_wait(&thread->wake, &thread->lock);
+                        clock_gettime(CLOCK_MONOTONIC, &deadline);
+                        continue;
+                }
+
+                if (!settings->step_at_a_time && settings->simulation_timestep > 0) {
+                        struct timespec now;
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        if (timespec_before(&now, &deadline)) {
+                                pthread_cond_timedwait(&thread->wake, &thread->lock, &deadline);
+                                continue;
+                        }
+
+                        // Don't try to catch up after falling behind
+                        timespec_add(&deadline, settings->simulation_timestep);
+                        if (timespec_before(&deadline, &now)) {
+                                deadline = now;
+                        }
+                }
+
+                if (settings->step_at_a_time) {
+                        thread->requested_steps--;
+                }
+                pthread_mutex_unlock(&thread->lock);
+
+                simulation_step(settings, thread->simulation);
+                checkpoint_step(thread->checkpoints, thread->simulation);
+                output_step(thread->output, thread->simulation);
+                if (thread->last_infected_tiles != NULL) {
+                        mark_stale_tiles(thread);
+                }
+
+                // The drawing thread only asks for a snapshot once it has
+                // the latest one in front, where it stays until the next
+                pthread_mutex_lock(&thread->lock);
+                record_history(thread->history, thread->simulation->step, &thread->simulation->tally);
+                bool wanted = thread->wanted;
+                const struct snapshot *previous = &thread->snapshots[thread->front];
+                pthread_mutex_unlock(&thread->lock);
+
+                // The back snapshot belongs to this thread alone
+                if (wanted) {
+                        take_snapshot(thread->simulation, &thread->snapshots[thread->back], previous);
+                }
+
+                pthread_mutex_lock(&thread->lock);
+                if (wanted) {
+                        int tmp = thread->back;
+                        thread->back = thread->middle;
+                        thread->middle = tmp;
+                        thread->fresh = true;
+                        thread->wanted = false;
+                }
+        }
+        pthread_mutex_unlock(&thread->lock);
+
+        return NULL;
+}
+
+static void start_simulation_thread(struct settings *settings, struct simulation *simulation,
+                                    struct checkpoint_writer *checkpoints,
+                                    struct output_sink *output,
+                                    struct simulation_thread *thread) {
+        thread->simulation = simulation;
+        thread->settings = settings;
+        thread->checkpoints = checkpoints;
+        thread->output = output;
+
+        // Grids too big to draw cell by cell are copied tile by tile
+        int tiles = (simulation->dimension + TILE_SIZE - 1) / TILE_SIZE;
+        bool by_tile = view_levels(simulation->dimension) > 0;
+        thread->last_infected_tiles = NULL;
+        if (by_tile) {
+                track_infected_tiles(simulation);
+                // Until a step says otherwise, any tile could have an infected individual
+                thread->last_infected_tiles = malloc(sizeof(bool) * tiles * tiles);
+                must_init(thread->last_infected_tiles != NULL, "snapshot tiles");
+                memset(thread->last_infected_tiles, true, sizeof(bool) * tiles * tiles);
+        }
+        for (int i=0; i<3; i++) {
+                struct snapshot *snapshot = &thread->snapshots[i];
+                snapshot->dimension = simulation->dimension;
+                snapshot->compact = simulation->compact;
+                snapshot->cells = alloc_grid(grid_cell_size(simulation) * grid_cells(simulation->dimension));
+                must_init(snapshot->cells != NULL, "snapshot");
+                snapshot->tiles = tiles;
+                snapshot->dirty = snapshot->stale = NULL;
+                if (by_tile) {
+                        snapshot->dirty = malloc(sizeof(bool) * tiles * tiles);
+                        must_init(snapshot->dirty != NULL, "snapshot tiles");
+                        snapshot->stale = malloc(sizeof(bool) * tiles * tiles);
+                        must_init(snapshot->stale != NULL, "snapshot tiles");
+                        memset(snapshot->stale, true, sizeof(bool) * tiles * tiles);
+                }
+        }
+        thread->back = 0;
+        thread->middle = 1;
+        thread->front = 2;
+        take_snapshot(simulation, &thread->snapshots[thread->front], NULL);
+        thread->fresh = false;
+        thread->wanted = true;
+
+        thread->history = malloc(sizeof(struct history));
+        must_init(thread->history != NULL, "history");
+        reset_history(thread->history);
+        record_history(thread->history, simulation->step, &simulation->tally);
+
+        thread->paused = false;
+        thread->quit = false;
+        thread->requested_steps = 0;
+#ifdef PROFILE
+        init_profile_ring(&thread->profile, 1, "simulation");
+#endif
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        must_init(pthread_cond_init(&thread->wake, &attr) == 0, "simulation thread condition");
+        pthread_condattr_destroy(&attr);
+        must_init(pthread_mutex_init(&thread->lock, NULL) == 0, "simulation thread lock");
+        must_init(pthread_create(&thread->thread, NULL, simulation_thread_main, thread) == 0,
+                  "simulation thread");
+}
+
+static void stop_simulation_thread(struct simulation_thread *thread) {
+        pthread_mutex_lock(&thread->lock);
+        thread->quit = true;
+        pthread_cond_signal(&thread->wake);
+        pthread_mutex_unlock(&thread->lock);
+        pthread_join(thread->thread, NULL);
+
+        pthread_cond_destroy(&thread->wake);
+        pthread_mutex_destroy(&thread->lock);
+        for (int i=0; i<3; i++) {
+                struct snapshot *snapshot = &thread->snapshots[i];
+                free_grid(snapshot->cells, (snapshot->compact ? sizeof(int8_t) : sizeof(int)) *
+                          grid_cells(snapshot->dimension));
+                free(snapshot->dirty);
+                free(snapshot->stale);
+                snapshot->cells = NULL;
+                snapshot->dirty = snapshot->stale = NULL;
+        }
+        free(thread->last_infected_tiles);
+        thread->last_infected_tiles = NULL;
+        free(thread->history);
+        thread->history = NULL;
+}
+
+/*
+ * Get the latest published generation to draw, asking for a newer one
+ * for next time. Returns whether it's new since the last call.
+ */
+static bool latest_snapshot(struct simulation_thread *thread, const struct snapshot **snapshot) {
+        pthread_mutex_lock(&thread->lock);
+        bool fresh = thread->fresh;
+        if (fresh) {
+                int tmp = thread->front;
+                thread->front = thread->middle;
+                thread->middle = tmp;
+                thread->fresh = false;
+        }
+        thread->wanted = true;
+        pthread_mutex_unlock(&thread->lock);
+
+        *snapshot = &thread->snapshots[thread->front];
+        return fresh;
+}
+
+static void toggle_simulation_pause(struct simulation_thread *thread) {
+        pthread_mutex_lock(&thread->lock);
+        thread->paused = !thread->paused;
+        pthread_cond_signal(&thread->wake);
+        pthread_mutex_unlock(&thread->lock);
+}
+
+static void request_simulation_step(struct simulation_thread *thread) {
+        pthread_mutex_lock(&thread->lock);
+        thread->requested_steps++;
+        pthread_cond_signal(&thread->wake);
+        pthread_mutex_unlock(&thread->lock);
+}
+#endif
+
+
+//////////////////////////////
+/////[ENSEMBLE FUNCTIONS]/////
+//////////////////////////////
+
+static int histogram_bin(long value) {
+        if (value < HISTOGRAM_EXACT) {
+                return (int)value;
+        }
+
+        int exponent = 63 - __builtin_clzl((unsigned long)value);
+        int mantissa = (int)(value >> (exponent - 3)) & (HISTOGRAM_SUBBINS - 1);
+        int bin = HISTOGRAM_EXACT + (exponent - 4) * HISTOGRAM_SUBBINS + mantissa;
+        return MIN(bin, HISTOGRAM_BINS - 1);
+}
+
+/*
+ * The value in the middle of the range a histogram bin covers.
+ */
+static long histogram_value(int bin) {
+        if (bin < HISTOGRAM_EXACT) {
+                return bin;
+        }
+
+        int exponent = 4 + (bin - HISTOGRAM_EXACT) / HISTOGRAM_SUBBINS;
+        long mantissa = HISTOGRAM_SUBBINS + (bin - HISTOGRAM_EXACT) % HISTOGRAM_SUBBINS;
+        long width = 1L << (exponent - 3);
+        return mantissa * width + width / 2;
+}
+
+/*
+ * The nearest-rank percentile of the runs counted in a histogram.
+ */
+static long histogram_percentile(const uint32_t *bins, int runs, double percentile) {
+        long rank = (long)ceil(percentile / 100 * runs);
+        long seen = 0;
+
+        for (int bin=0; bin<HISTOGRAM_BINS; bin++) {
+                seen += bins[bin];
+                if (seen >= MAX(rank, 1)) {
+                        return histogram_value(bin);
+                }
+        }
+        return histogram_value(HISTOGRAM_BINS - 1);
+}
+
+static void merge_run(struct ensemble *ensemble, const struct tally *curve) {
+        pthread_mutex_lock(&ensemble->lock);
+        for (int step=0; step<=ensemble->steps; step++) {
+                struct ensemble_step *stats = &ensemble->stats[step];
+                stats->infected_sum += curve[step].infected;
+                stats->dead_sum += curve[step].dead;
+                stats->infected_bins[histogram_bin(curve[step].infected)]++;
+                stats->dead_bins[histogram_bin(curve[step].dead)]++;
+        }
+        pthread_mutex_unlock(&ensemble->lock);
+}
+
+/*
+ * Take runs until there are none left, reusing the same grids for all
+ * of them. Each run is stepped on this thread alone.
+ */
+static void *ensemble_worker(void *arg) {
+        struct ensemble *ensemble = arg;
+        struct settings settings = *ensemble->settings;
+        settings.threads = 1;
+
+        struct simulation simulation;
+        create_simulation(&settings, &simulation);
+        struct tally *curve = malloc(sizeof(struct tally) * (ensemble->steps + 1));
+        must_init(curve != NULL, "ensemble curve");
+
+        for (;;) {
+                int run = __atomic_fetch_add(&ensemble->next_run, 1, __ATOMIC_RELAXED);
+                if (run >= ensemble->runs) {
+                        break;
+                }
+
+                settings.rng_seed = offset_seed(ensemble->settings->rng_seed, run);
+                init_simulation(&simulation);
+                for (int step=0; step<=ensemble->steps; step++) {
+                        // Nothing changes once no one is infected
+                        curve[step] = simulation.tally;
+                        if (step < ensemble->steps && simulation.tally.infected > 0) {
+                                simulation_step(&settings, &simulation);
+                        }
+                }
+
+                merge_run(ensemble, curve);
+        }
+
+        free(curve);
+        destroy_simulation(&simulation);
+        return NULL;
+}
+
+static int run_ensemble(struct settings *settings) {
+        struct ensemble ensemble = {
+                .settings = settings,
+                .runs = settings->runs,
+                .steps = settings->headless_steps,
+                .next_run = 0,
+        };
+        ensemble.stats = calloc(ensemble.steps + 1, sizeof(struct ensemble_step));
+        must_init(ensemble.stats != NULL, "ensemble statistics");
+        must_init(pthread_mutex_init(&ensemble.lock, NULL) == 0, "ensemble lock");
+
+        int workers = MAX(1, MIN(settings->threads, ensemble.runs));
+        pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+        must_init(threads != NULL, "ensemble threads");
+        for (int i=1; i<workers; i++) {
+                must_init(pthread_create(&threads[i], NULL, ensemble_worker, &ensemble) == 0,
+                          "ensemble thread");
+        }
+        ensemble_worker(&ensemble);
+        for (int i=1; i<workers; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        printf("step infected_mean infected_p5 infected_p50 infected_p95 "
+               "dead_mean dead_p5 dead_p50 dead_p95\n");
+        for (int step=0; step<=ensemble.steps; step++) {
+                const struct ensemble_step *stats = &ensemble.stats[step];
+                printf("%d %f %ld %ld %ld %f %ld %ld %ld\n", step,
+                       (double)stats->infected_sum / ensemble.runs,
+                       histogram_percentile(stats->infected_bins, ensemble.runs, 5),
+                       histogram_percentile(stats->infected_bins, ensemble.runs, 50),
+                       histogram_percentile(stats->infected_bins, ensemble.runs, 95),
+                       (double)stats->dead_sum / ensemble.runs,
+                       histogram_percentile(stats->dead_bins, ensemble.runs, 5),
+                       histogram_percentile(stats->dead_bins, ensemble.runs, 50),
+                       histogram_percentile(stats->dead_bins, ensemble.runs, 95));
+        }
+
+        free(threads);
+        pthread_mutex_destroy(&ensemble.lock);
+        free(ensemble.stats);
+        return 0;
+}
+
+
+///////////////////////////
+/////[SWEEP FUNCTIONS]/////
+///////////////////////////
+
+static double get_sweep_field(const struct settings *settings, enum sweep_field field) {
+        switch (field) {
+        case SWEEP_LETHALITY:
+                return settings->lethality;
+        case SWEEP_INFECTIOUSNESS:
+                return settings->infectiousness;
+        case SWEEP_IMMUNITY:
+                return settings->max_infected_value;
+        case SWEEP_IMMUNIZATION:
+                return settings->immunization_chance;
+        case SWEEP_DIMENSION:
+                return settings->simulation_grid_dimension;
+        case SWEEP_FIELDS:
+                break;
+        }
+        return 0;
+}
+
+static void set_sweep_field(struct settings *settings, enum sweep_field field, double value) {
+        switch (field) {
+        case SWEEP_LETHALITY:
+                settings->lethality = value;
+                break;
+        case SWEEP_INFECTIOUSNESS:
+                settings->infectiousness = value;
+                break;
+        case SWEEP_IMMUNITY:
+                settings->max_infected_value = (int)lround(value);
+                break;
+        case SWEEP_IMMUNIZATION:
+                settings->immunization_chance = value;
+                break;
+        case SWEEP_DIMENSION:
+                settings->simulation_grid_dimension = (int)lround(value);
+                break;
+        case SWEEP_FIELDS:
+                break;
+        }
+}
+
+static int sweep_count(const struct sweep_range *range) {
+        if (!range->set) {
+                return 1;
+        }
+        // Allow for rounding errors in the last step
+        return (int)floor((range->stop - range->start) / range->step + 1e-9) + 1;
+}
+
 /*
- * Randomly return true with a given probability.
+ * Set up the settings of one run of the sweep, numbering combinations
+ * with the first setting changing slowest and the seed fastest.
  */
-static bool chance(double probability) {
-        return (double)rand() / (double)RAND_MAX < probability;
-}
+static void sweep_job_settings(const struct sweep *sweep, int job,
+                               struct settings *settings, struct sweep_result *result) {
+        int seed = job % sweep->seeds;
+        job /= sweep->seeds;
 
-static double interpolate(double min, double max, int maxval, int currval) {
-        return min+(((max - min)/maxval)*currval);
+        for (int field=SWEEP_FIELDS-1; field>=0; field--) {
+                const struct sweep_range *range = &sweep->settings->sweep[field];
+                if (range->set) {
+                        int index = job % sweep->counts[field];
+                        job /= sweep->counts[field];
+                        set_sweep_field(settings, field, range->start + index*range->step);
+                }
+                result->values[field] = get_sweep_field(settings, field);
+        }
+
+        settings->rng_seed = offset_seed(sweep->settings->rng_seed, seed);
+        result->seed = settings->rng_seed;
 }
 
+static void *sweep_worker(void *arg) {
+        struct sweep *sweep = arg;
+        struct settings settings = *sweep->settings;
+        settings.threads = 1;
 
-////////////////////////////////
-/////[SIMULATION FUNCTIONS]/////
-////////////////////////////////
+        // Grids are kept between runs that can share them
+        struct simulation simulation;
+        bool created = false;
 
-static void init_simulation(struct settings *settings, int *state) {
-        memset(state, 0, sizeof(int)*settings->simulation_grid_dimension*settings->simulation_grid_dimension);
-        int mid = settings->simulation_grid_dimension/2;
-        state[mid+mid*settings->simulation_grid_dimension] = 1;
-}
+        for (;;) {
+                int job = __atomic_fetch_add(&sweep->next_job, 1, __ATOMIC_RELAXED);
+                if (job >= sweep->jobs) {
+                        break;
+                }
 
-static bool isinfected(const int *state, int x, int y, int size) {
-        return state[y+x*size] > 0;
-}
+                struct sweep_result *result = &sweep->results[job];
+                sweep_job_settings(sweep, job, &settings, result);
 
-static void advance_state(const int *current, int *next, struct settings *settings, int x, int y, int size) {
-        int index = y + x * size;
-        if (current[index] == CURED_STATE || current[index] == DEAD_STATE) {
-                next[index] = current[index];
-        } else if (current[index] != 0) {
-                if (chance(settings->lethality)) {
-                        next[index] = DEAD_STATE;
-                } else {
-                        next[index] = current[index]+1;
-                        if (next[index] > settings->max_infected_value) {
-                                if (chance(settings->immunization_chance)) {
-                                        next[index] = CURED_STATE;
-                                } else {
-                                        next[index] = settings->max_infected_value;
-                                }
-                        }
+                bool compact = settings.max_infected_value <= COMPACT_MAX_INFECTED_VALUE;
+                if (created && (simulation.dimension != settings.simulation_grid_dimension ||
+                                simulation.compact != compact)) {
+                        destroy_simulation(&simulation);
+                        created = false;
                 }
-        } else {
-                if ((x > 0      && isinfected(current, x-1, y, size)) ||
-                    (x < size-1 && isinfected(current, x+1, y, size)) ||
-                    (y > 0      && isinfected(current, x, y-1, size)) ||
-                    (y < size-1 && isinfected(current, x, y+1, size))) {
-                        if (chance(settings->infectiousness)) {
-                                next[index] = 1;
-                        } else {
-                                next[index] = 0;
+                if (!created) {
+                        create_simulation(&settings, &simulation);
+                        created = true;
+                }
+
+                init_simulation(&simulation);
+                result->peak_infected = simulation.tally.infected;
+                result->peak_step = 0;
+                result->extinction_step = -1;
+                for (int step=0;; step++) {
+                        if (simulation.tally.infected > result->peak_infected) {
+                                result->peak_infected = simulation.tally.infected;
+                                result->peak_step = step;
                         }
-                } else {
-                        next[index] = 0;
+                        if (simulation.tally.infected == 0) {
+                                result->extinction_step = step;
+                                break;
+                        }
+                        if (settings.headless_steps > 0 && step >= settings.headless_steps) {
+                                break;
+                        }
+                        simulation_step(&settings, &simulation);
                 }
+                result->final = simulation.tally;
         }
+
+        if (created) {
+                destroy_simulation(&simulation);
+        }
+        return NULL;
 }
 
-static int *simulation_step(struct settings *settings, int *state) {
-        size_t size = sizeof(int) * settings->simulation_grid_dimension * settings->simulation_grid_dimension;
-        int *next_state = malloc(size);
-        
-        for (int i=0; i<settings->simulation_grid_dimension; i++) {
-                for (int j=0; j<settings->simulation_grid_dimension; j++) {
-                        advance_state(state, next_state, settings, i, j, settings->simulation_grid_dimension);
+static int run_sweep(struct settings *settings) {
+        struct sweep sweep = {
+                .settings = settings,
+                .seeds = MAX(1, settings->runs),
+                .next_job = 0,
+        };
+
+        long jobs = sweep.seeds;
+        for (int field=0; field<SWEEP_FIELDS; field++) {
+                sweep.counts[field] = sweep_count(&settings->sweep[field]);
+                jobs *= sweep.counts[field];
+        }
+        if (jobs > INT_MAX) {
+                fprintf(stderr, "too many runs in sweep: %ld\n", jobs);
+                return 1;
+        }
+        sweep.jobs = (int)jobs;
+        sweep.results = malloc(sizeof(struct sweep_result) * sweep.jobs);
+        must_init(sweep.results != NULL, "sweep results");
+
+        int workers = MAX(1, MIN(settings->threads, sweep.jobs));
+        pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+        must_init(threads != NULL, "sweep threads");
+        for (int i=1; i<workers; i++) {
+                must_init(pthread_create(&threads[i], NULL, sweep_worker, &sweep) == 0,
+                          "sweep thread");
+        }
+        sweep_worker(&sweep);
+        for (int i=1; i<workers; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        for (int field=0; field<SWEEP_FIELDS; field++) {
+                printf("%s ", sweep_field_names[field]);
+        }
+        printf("seed healthy infected cured dead peak_infected peak_step extinction_step\n");
+        for (int job=0; job<sweep.jobs; job++) {
+                const struct sweep_result *result = &sweep.results[job];
+                for (int field=0; field<SWEEP_FIELDS; field++) {
+                        printf("%g ", result->values[field]);
                 }
+                printf("%d %ld %ld %ld %ld %ld %d %d\n", result->seed,
+                       result->final.healthy, result->final.infected,
+                       result->final.cured, result->final.dead,
+                       result->peak_infected, result->peak_step, result->extinction_step);
         }
 
-        free(state);
-        return next_state;
+        free(threads);
+        free(sweep.results);
+        return 0;
 }
 
 
@@ -509,6 +5265,27 @@ static int *simulation_step(struct settings *settings, int *state) {
 /////[UI FUNCTIONS]/////
 ////////////////////////
 
+#ifndef NO_ALLEGRO
+
+static ALLEGRO_COLOR map_rgb(struct rgb rgb) {
+        return al_map_rgb(rgb.r, rgb.g, rgb.b);
+}
+
+/*
+ * Map the colours given in the settings, which takes Allegro to be
+ * initialized.
+ */
+static void map_colors(struct settings *settings) {
+        settings->background_color = map_rgb(settings->background_rgb);
+        settings->text_color = map_rgb(settings->text_rgb);
+        settings->ui_color = map_rgb(settings->ui_rgb);
+        settings->healthy_color = map_rgb(settings->healthy_rgb);
+        settings->cured_color = map_rgb(settings->cured_rgb);
+        settings->dead_color = map_rgb(settings->dead_rgb);
+        settings->infected_color_min = map_rgb(settings->infected_rgb_min);
+        settings->infected_color_max = map_rgb(settings->infected_rgb_max);
+}
+
 static ALLEGRO_COLOR get_cell_color(struct settings *settings, int state) {
         if (state == 0) {
                 return settings->healthy_color;
@@ -540,21 +5317,276 @@ static ALLEGRO_COLOR get_cell_color(struct settings *settings, int state) {
         }
 }
 
-static void draw_ui_rectangle(int offx, int offy, struct settings *settings, int *state) {
-        int size = DISPLAYY / settings->simulation_grid_dimension;
-        
-        for (int i=0; i<settings->simulation_grid_dimension; i++) {
-                for (int j=0; j<settings->simulation_grid_dimension; j++) {
-                        ALLEGRO_COLOR color = get_cell_color(settings,
-                                                             state[j+i*settings->simulation_grid_dimension]);
-                        
-                        int x = offx + i * size;
-                        int y = offy + j * size;
-                        int xx = offx + x + size;
-                        int yy = offy + y + size;
-                        al_draw_filled_rectangle(x, y, xx, yy, color);
+/*
+ * Position of a cell state in the colour table: infected ages, healthy
+ * being 0, followed by cured and dead.
+ */
+static ALWAYS_INLINE int color_index(int max_infected_value, int state) {
+        if (state == CURED_STATE) {
+                return max_infected_value + 1;
+        } else if (state == DEAD_STATE) {
+                return max_infected_value + 2;
+        }
+        return state;
+}
+
+/*
+ * Pack a colour as a pixel in ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, which
+ * is red, green, blue and alpha bytes in that order in memory.
+ */
+static uint32_t color_pixel(ALLEGRO_COLOR color) {
+        unsigned char bytes[4];
+        uint32_t pixel;
+
+        al_unmap_rgba(color, &bytes[0], &bytes[1], &bytes[2], &bytes[3]);
+        memcpy(&pixel, bytes, sizeof(pixel));
+        return pixel;
+}
+
+static void create_grid_view(struct settings *settings, int dim, struct grid_view *view) {
+        int max_infected_value = settings->max_infected_value;
+
+        view->max_infected_value = max_infected_value;
+        view->colors = malloc(sizeof(uint32_t) * (max_infected_value + 3));
+        must_init(view->colors != NULL, "color table");
+        for (int state=0; state<=max_infected_value; state++) {
+                view->colors[color_index(max_infected_value, state)] =
+                        color_pixel(get_cell_color(settings, state));
+        }
+        view->colors[color_index(max_infected_value, CURED_STATE)] =
+                color_pixel(get_cell_color(settings, CURED_STATE));
+        view->colors[color_index(max_infected_value, DEAD_STATE)] =
+                color_pixel(get_cell_color(settings, DEAD_STATE));
+
+        view->dimension = dim;
+        view->x = 0;
+        view->y = 0;
+        view->span = dim;
+
+        view->levels = view_levels(dim);
+        view->level_dimensions[0] = dim;
+        view->level_pixels[0] = NULL;
+        for (int level=1; level<=view->levels; level++) {
+                int level_dim = (int)(((long)dim + (1L << level) - 1) >> level);
+                view->level_dimensions[level] = level_dim;
+                view->level_pixels[level] = alloc_grid(sizeof(uint32_t) * level_dim * level_dim);
+                must_init(view->level_pixels[level] != NULL, "level of detail");
+        }
+        view->built = false;
+}
+
+static void destroy_grid_view(struct grid_view *view) {
+        for (int level=1; level<=view->levels; level++) {
+                int level_dim = view->level_dimensions[level];
+                free_grid(view->level_pixels[level], sizeof(uint32_t) * level_dim * level_dim);
+                view->level_pixels[level] = NULL;
+        }
+        free(view->colors);
+        view->colors = NULL;
+}
+
+static void create_grid_renderer(struct settings *settings, const struct simulation *simulation,
+                                 struct grid_renderer *renderer) {
+        create_grid_view(settings, simulation->dimension, &renderer->view);
+
+        // Scaled without filtering so that each cell stays a solid square
+        int size = MIN(simulation->dimension, DISPLAYY);
+        int flags = al_get_new_bitmap_flags();
+        al_set_new_bitmap_flags(flags & ~(ALLEGRO_MIN_LINEAR | ALLEGRO_MAG_LINEAR));
+        renderer->bitmap = al_create_bitmap(size, size);
+        al_set_new_bitmap_flags(flags);
+        must_init(renderer->bitmap != NULL, "grid bitmap");
+}
+
+static void destroy_grid_renderer(struct grid_renderer *renderer) {
+        al_destroy_bitmap(renderer->bitmap);
+        destroy_grid_view(&renderer->view);
+        renderer->bitmap = NULL;
+}
+
+static ALWAYS_INLINE uint32_t cell_pixel(const struct grid_view *view, const struct snapshot *snapshot,
+                                         int x, int y, bool compact) {
+        int state = load_cell(snapshot->cells, grid_index(snapshot->dimension, x, y), compact);
+        return view->colors[color_index(view->max_infected_value, state)];
+}
+
+/*
+ * Average 1, 2 or 4 pixels channel by channel, with each channel
+ * spread into 16 bits of a 64 bit word so all four add up at once.
+ */
+static ALWAYS_INLINE uint32_t average_pixels(const uint32_t *pixels, int count) {
+        const uint64_t channels = UINT64_C(0x00FF00FF00FF00FF);
+        int shift = count == 4 ? 2 : count == 2 ? 1 : 0;
+
+        uint64_t sums = (uint64_t)(count / 2) * UINT64_C(0x0001000100010001);
+        for (int i=0; i<count; i++) {
+                sums += (pixels[i] & 0x00FF00FFu) | ((uint64_t)(pixels[i] & 0xFF00FF00u) << 24);
+        }
+        sums = (sums >> shift) & channels;
+        return (uint32_t)(sums & 0x00FF00FFu) | (uint32_t)((sums >> 24) & 0xFF00FF00u);
+}
+
+/*
+ * Redo the blocks of every level of detail that take in a tile. Blocks
+ * past the first level are averaged from the four below them, so they
+ * are a little off at the edge of grids that aren't a power of two
+ * across, which doesn't show.
+ */
+static ALWAYS_INLINE void update_view_tile(struct grid_view *view, const struct snapshot *snapshot,
+                                           int tile_row, int tile_col, bool compact) {
+        int first_x = tile_row * TILE_SIZE, end_x = MIN(first_x + TILE_SIZE, view->dimension);
+        int first_y = tile_col * TILE_SIZE, end_y = MIN(first_y + TILE_SIZE, view->dimension);
+
+        for (int level=1; level<=view->levels; level++) {
+                int below_dim = view->level_dimensions[level-1];
+                int level_dim = view->level_dimensions[level];
+                uint32_t *pixels = view->level_pixels[level];
+                const uint32_t *below = view->level_pixels[level-1];
+
+                for (int x=first_x>>level; x<=(end_x-1)>>level; x++) {
+                        for (int y=first_y>>level; y<=(end_y-1)>>level; y++) {
+                                uint32_t children[4];
+                                int count = 0;
+                                for (int i=2*x; i<MIN(2*x+2, below_dim); i++) {
+                                        for (int j=2*y; j<MIN(2*y+2, below_dim); j++) {
+                                                children[count++] = level == 1 ?
+                                                        cell_pixel(view, snapshot, i, j, compact) :
+                                                        below[(size_t)i*below_dim + j];
+                                        }
+                                }
+                                pixels[(size_t)x*level_dim + y] = average_pixels(children, count);
+                        }
+                }
+        }
+}
+
+/*
+ * Bring the levels of detail up to date with a new snapshot, redoing
+ * only the tiles that changed since the last one, or all of them the
+ * first time.
+ */
+static void update_grid_view(struct grid_view *view, const struct snapshot *snapshot) {
+        if (view->levels == 0) {
+                return;
+        }
+
+        int tiles = (view->dimension + TILE_SIZE - 1) / TILE_SIZE;
+        for (int tile_row=0; tile_row<tiles; tile_row++) {
+                for (int tile_col=0; tile_col<tiles; tile_col++) {
+                        if (view->built && snapshot->dirty != NULL &&
+                            !snapshot->dirty[tile_row*tiles + tile_col]) {
+                                continue;
+                        }
+                        if (snapshot->compact) {
+                                update_view_tile(view, snapshot, tile_row, tile_col, true);
+                        } else {
+                                update_view_tile(view, snapshot, tile_row, tile_col, false);
+                        }
+                }
+        }
+        view->built = true;
+}
+
+/*
+ * Write the cells in view as pixels, one per cell if they fit across
+ * the window and otherwise one per window pixel, taken from the level
+ * of detail with as many cells to a block as there are to a pixel, or
+ * just under. Returns how many pixels across were written.
+ */
+static ALWAYS_INLINE int fill_view_pixels(const struct grid_view *view, const struct snapshot *snapshot,
+                                          char *pixels, int pitch, bool compact) {
+        int span = view->span;
+
+        // Grid rows are drawn as columns
+        if (span <= DISPLAYY) {
+                for (int i=0; i<span; i++) {
+                        for (int j=0; j<span; j++) {
+                                uint32_t *pixel = (uint32_t *)(pixels + (ptrdiff_t)j*pitch) + i;
+                                *pixel = cell_pixel(view, snapshot, view->x + i, view->y + j, compact);
+                        }
+                }
+                return span;
+        }
+
+        int level = 0;
+        while (level < view->levels && ((long)DISPLAYY << (level + 1)) <= span) {
+                level++;
+        }
+        int level_dim = view->level_dimensions[level];
+        const uint32_t *level_pixels = view->level_pixels[level];
+
+        for (int i=0; i<DISPLAYY; i++) {
+                int x = view->x + (int)((long)i * span / DISPLAYY);
+                for (int j=0; j<DISPLAYY; j++) {
+                        int y = view->y + (int)((long)j * span / DISPLAYY);
+                        uint32_t *pixel = (uint32_t *)(pixels + (ptrdiff_t)j*pitch) + i;
+                        if (level == 0) {
+                                *pixel = cell_pixel(view, snapshot, x, y, compact);
+                        } else {
+                                *pixel = level_pixels[(size_t)(x >> level)*level_dim + (y >> level)];
+                        }
+                }
+        }
+        return DISPLAYY;
+}
+
+/*
+ * Keep the view inside the grid.
+ */
+static void clamp_grid_view(struct grid_view *view) {
+        view->span = MAX(MIN(view->span, view->dimension), MIN(VIEW_MIN_SPAN, view->dimension));
+        view->x = MAX(0, MIN(view->x, view->dimension - view->span));
+        view->y = MAX(0, MIN(view->y, view->dimension - view->span));
+}
+
+/*
+ * Halve or double how many cells are in view, keeping it centred on
+ * the same cell.
+ */
+static void zoom_grid_view(struct grid_view *view, bool in) {
+        int centre_x = view->x + view->span / 2;
+        int centre_y = view->y + view->span / 2;
+        view->span = in ? view->span / 2 : (int)MIN((long)view->span * 2, view->dimension);
+        clamp_grid_view(view);
+        view->x = centre_x - view->span / 2;
+        view->y = centre_y - view->span / 2;
+        clamp_grid_view(view);
+}
+
+/*
+ * Move the view a quarter of the way across in a direction.
+ */
+static void pan_grid_view(struct grid_view *view, int dx, int dy) {
+        int step = MAX(1, view->span / 4);
+        view->x += dx * step;
+        view->y += dy * step;
+        clamp_grid_view(view);
+}
+
+static void draw_ui_rectangle(int offx, int offy, struct grid_renderer *renderer,
+                              const struct snapshot *snapshot, bool step) {
+        uint64_t start = profile_begin();
+        if (step || !renderer->view.built) {
+                update_grid_view(&renderer->view, snapshot);
+        }
+
+        ALLEGRO_LOCKED_REGION *region = al_lock_bitmap(renderer->bitmap,
+                                                       ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE,
+                                                       ALLEGRO_LOCK_WRITEONLY);
+        if (region != NULL) {
+                int size;
+                if (snapshot->compact) {
+                        size = fill_view_pixels(&renderer->view, snapshot, region->data, region->pitch, true);
+                } else {
+                        size = fill_view_pixels(&renderer->view, snapshot, region->data, region->pitch, false);
                 }
+
+                al_unlock_bitmap(renderer->bitmap);
+                al_draw_scaled_bitmap(renderer->bitmap,
+                                      0, 0, size, size,
+                                      offx, offy, DISPLAYY, DISPLAYY, 0);
         }
+        profile_end(PROFILE_RENDER, start);
 }
 
 __attribute__((format (printf, 7, 8)))
@@ -573,43 +5605,72 @@ static void draw_ui_panel_text(ALLEGRO_FONT *font,
         al_draw_text(font, color, x2, y, ALLEGRO_ALIGN_RIGHT, value);
 }
 
+/*
+ * Plot the history of the whole run so far, from the finest level
+ * with no more buckets than the graph is wide, one per pixel. Each
+ * series is drawn as a line through the mean of every bucket, and a
+ * bar from its least to its greatest, so peaks shorter than a bucket
+ * still show.
+ */
 static void plot_graph(int offx, int offy, int width, int height,
-                       int healthy, int infected, int cured, int dead,
-                       struct settings *settings, bool step) {
-        static int len = 0;
-        static int *hist[4] = {NULL,NULL,NULL,NULL};
-        int curr[4] = {healthy,infected,cured,dead};
-        ALLEGRO_COLOR colors[4] = {settings->healthy_color, settings->infected_color_max,
-                                   settings->cured_color, settings->dead_color};
-        int total = healthy+infected+cured+dead;
+                       const struct tally *tally, struct settings *settings,
+                       struct simulation_thread *thread) {
+        // Only the drawing thread plots
+        static ALLEGRO_VERTEX means[HISTORY_SERIES][HISTORY_BUCKETS];
+        static ALLEGRO_VERTEX ranges[HISTORY_SERIES][2 * HISTORY_BUCKETS];
+        ALLEGRO_COLOR colors[HISTORY_SERIES] = {settings->healthy_color, settings->infected_color_max,
+                                                settings->cured_color, settings->dead_color};
+        double total = tally->healthy+tally->infected+tally->cured+tally->dead;
+        uint64_t start = profile_begin();
 
-        bool grow = len < settings->steplimit && step;
+        width = MIN(width, HISTORY_BUCKETS);
+        int points = 0;
 
-        if (grow) {
-                len++;
+        pthread_mutex_lock(&thread->lock);
+        const struct history *history = thread->history;
+        int level = 0;
+        while (level < HISTORY_LEVELS - 1 &&
+               (history->last_step >> level) - (history->first_step >> level) >= (uint64_t)width) {
+                level++;
         }
-        
-        for (int i=0; i<4; i++) {
-                if (hist[i] == NULL) {
-                        hist[i] = malloc(sizeof(int) * settings->steplimit);
+
+        for (uint64_t index=history->first_step>>level; index<=history->last_step>>level; index++) {
+                const struct history_bucket *bucket = &history->levels[level][index % HISTORY_BUCKETS];
+                if (bucket->index != index) {
+                        continue;
                 }
-                
-                if (grow) {
-                        hist[i][len-1] = curr[i];
+
+                float x = offx + points;
+                for (int i=0; i<HISTORY_SERIES; i++) {
+                        float mean = bucket->sum[i] / bucket->count;
+                        means[i][points] = (ALLEGRO_VERTEX){
+                                .x = x, .y = offy + height - mean*height/total, .z = 0, .color = colors[i],
+                        };
+                        ranges[i][2*points] = (ALLEGRO_VERTEX){
+                                .x = x, .y = offy + height - bucket->min[i]*height/total, .z = 0,
+                                .color = colors[i],
+                        };
+                        ranges[i][2*points+1] = (ALLEGRO_VERTEX){
+                                .x = x, .y = offy + height - bucket->max[i]*height/total - 1, .z = 0,
+                                .color = colors[i],
+                        };
                 }
-                
-                for (int j=0; j<len; j++) {
-                        if (j >= len - width) {
-                                int x = offx + j - MAX(0, len-width);
-                                int y = offy + height - hist[i][j]*height/total;
-                                al_draw_pixel(x, y, colors[i]);
-                        }
+                points++;
+        }
+        pthread_mutex_unlock(&thread->lock);
+
+        for (int i=0; i<HISTORY_SERIES; i++) {
+                if (points > 1) {
+                        al_draw_prim(means[i], NULL, NULL, 0, points, ALLEGRO_PRIM_LINE_STRIP);
                 }
+                al_draw_prim(ranges[i], NULL, NULL, 0, 2 * points, ALLEGRO_PRIM_LINE_LIST);
         }
+        profile_end(PROFILE_GRAPH, start);
 }
 
 static void draw_ui_panel(int offx, int offy, int width, int height,
-                          struct settings *settings, int *state, bool step) {
+                          struct settings *settings, const struct snapshot *snapshot,
+                          struct simulation_thread *thread) {
         al_draw_line(offx+0, offy+0,
                      offx+0, offy+DISPLAYY,
                      settings->ui_color, 4);
@@ -642,21 +5703,50 @@ static void draw_ui_panel(int offx, int offy, int width, int height,
 
         y += 10;
 
-        int healthy, infected, cured, dead;
-        tally_state(state, settings->simulation_grid_dimension, &healthy, &infected, &cured, &dead);
+        const struct tally *tally = &snapshot->tally;
         
         draw_ui_panel_text(settings->text_font, settings->healthy_color,
                            offx+x1, offx+x2, offy+(y+=10),
-                           "Healthy:", "%d", healthy);
+                           "Healthy:", "%ld", tally->healthy);
         draw_ui_panel_text(settings->text_font, settings->infected_color_max,
                            offx+x1, offx+x2, offy+(y+=10),
-                           "Infected:", "%d", infected);
+                           "Infected:", "%ld", tally->infected);
         draw_ui_panel_text(settings->text_font, settings->cured_color,
                            offx+x1, offx+x2, offy+(y+=10),
-                           "Cured:", "%d", cured);
+                           "Cured:", "%ld", tally->cured);
         draw_ui_panel_text(settings->text_font, settings->dead_color,
                            offx+x1, offx+x2, offy+(y+=10),
-                           "Dead:", "%d", dead);
+                           "Dead:", "%ld", tally->dead);
+
+#ifdef PROFILE
+        y += 30;
+
+        al_draw_line(offx+0, offy+y,
+                     offx+width, offy+y,
+                     settings->ui_color, 4);
+
+        y += 10;
+
+        double step_ms, steps_per_second, render_ms, frame_ms, frames_per_second, unused;
+        profile_stats(&thread->profile, PROFILE_STEP, &step_ms, &steps_per_second);
+        profile_stats(profile_ring, PROFILE_RENDER, &render_ms, &unused);
+        profile_stats(profile_ring, PROFILE_FRAME, &frame_ms, &frames_per_second);
+
+        draw_ui_panel_text(settings->text_font, settings->text_color,
+                           offx+x1, offx+x2, offy+(y+=10),
+                           "Step:", "%.2f ms", step_ms);
+        draw_ui_panel_text(settings->text_font, settings->text_color,
+                           offx+x1, offx+x2, offy+(y+=10),
+                           "Render:", "%.2f ms", render_ms);
+        draw_ui_panel_text(settings->text_font, settings->text_color,
+                           offx+x1, offx+x2, offy+(y+=10),
+                           "Steps/s:", "%.1f", steps_per_second);
+        draw_ui_panel_text(settings->text_font, settings->text_color,
+                           offx+x1, offx+x2, offy+(y+=10),
+                           "FPS:", "%.1f", frames_per_second);
+#else
+        (void)thread;
+#endif
 
         y += 30;
 
@@ -667,51 +5757,48 @@ static void draw_ui_panel(int offx, int offy, int width, int height,
         y += 30;
 
         plot_graph(offx+x1, offy+y, width-60, height-y-30,
-                   healthy, infected, cured, dead, settings, step);
+                   tally, settings, thread);
 }
 
-static void draw_ui(struct settings *settings, int *state, bool step) {
+static void draw_ui(struct settings *settings, struct grid_renderer *renderer,
+                    const struct snapshot *snapshot, struct simulation_thread *thread,
+                    bool step) {
         al_clear_to_color(settings->background_color);
-        draw_ui_rectangle(0, 0, settings, state);
+        draw_ui_rectangle(0, 0, renderer, snapshot, step);
         draw_ui_panel(DISPLAYY, 0,
                       DISPLAYX-DISPLAYY, DISPLAYY,
-                      settings, state, step);
+                      settings, snapshot, thread);
 }
 
 
-/////////////////////////
-/////[MAIN FUNCTION]/////
-/////////////////////////
+/*
+ * Open the window and draw the simulation, which runs on its own
+ * thread, until the user closes it.
+ */
+static int run_interactive(struct settings *settings) {
+#ifdef PROFILE
+        static struct profile_ring ring;
+        init_profile_ring(&ring, 0, "drawing");
+        start_profile_ring(&ring);
+#endif
 
-int main(int argc, char *argv[]) {
         // Initialize graphics
         must_init(al_init(), "allegro");
+        map_colors(settings);
 
         // Initialize primitive drawing module
         must_init(al_init_primitives_addon(), "primitives");
-        
-        // Read settings from arguments
-        struct settings settings;
-        parse_args(argc, argv, &settings);
-        
-        // Seed RNG
-        srand(settings.rng_seed);
 
         // Initialize keyboard
         must_init(al_install_keyboard(), "keyboard");
 
         // Create font
-        settings.text_font = al_create_builtin_font();
-        must_init(settings.text_font, "font");
+        settings->text_font = al_create_builtin_font();
+        must_init(settings->text_font, "font");
 
         // Set up timers
         ALLEGRO_TIMER *draw_timer = al_create_timer(1.0 / 30.0);
         must_init(draw_timer, "draw timer");
-        ALLEGRO_TIMER *simulation_timer = NULL;
-        if (!settings.step_at_a_time) {
-                simulation_timer = al_create_timer(settings.simulation_timestep);
-                must_init(simulation_timer, "simulation timer");
-        }
 
         // Set up event queue
         ALLEGRO_EVENT_QUEUE* queue = al_create_event_queue();
@@ -728,52 +5815,63 @@ int main(int argc, char *argv[]) {
         al_register_event_source(queue, al_get_keyboard_event_source());
         al_register_event_source(queue, al_get_display_event_source(display));
         al_register_event_source(queue, al_get_timer_event_source(draw_timer));
-        if (simulation_timer != NULL) {
-                al_register_event_source(queue, al_get_timer_event_source(simulation_timer));
-        }
-
-        // Start timers
-        al_start_timer(draw_timer);
-        if (simulation_timer != NULL) {
-                al_start_timer(simulation_timer);
-        }
 
         // Allocate and initialize memory for simulation
-        size_t simulation_size = sizeof(int) *
-                settings.simulation_grid_dimension *
-                settings.simulation_grid_dimension;
-        int *simulation_state = malloc(simulation_size);
-        init_simulation(&settings, simulation_state);
+        struct simulation simulation;
+        create_simulation(settings, &simulation);
+        start_simulation(settings, &simulation);
+
+        // Set up grid rendering
+        struct grid_renderer renderer;
+        create_grid_renderer(settings, &simulation, &renderer);
+
+        // Start simulating and drawing
+        struct checkpoint_writer checkpoints;
+        start_checkpoint_writer(settings, &simulation, &checkpoints);
+        struct output_sink output;
+        start_output_sink(settings, &output);
+        output_step(&output, &simulation);
+        struct simulation_thread simulation_thread;
+        start_simulation_thread(settings, &simulation, &checkpoints, &output, &simulation_thread);
+        al_start_timer(draw_timer);
         
         bool done = false;
         bool redraw = true;
-        bool step = false;
-        bool paused = false;
         ALLEGRO_EVENT event;
         for(;;) {
                 al_wait_for_event(queue, &event);
                 
                 switch(event.type) {
                 case ALLEGRO_EVENT_TIMER:
-                        if (event.timer.source == draw_timer) {
-                                redraw = true;
-                        } else {
-                                if (!paused) {
-                                        simulation_state = simulation_step(&settings, simulation_state);
-                                }
-                        }
+                        redraw = true;
                         break;
 
                 case ALLEGRO_EVENT_KEY_DOWN:
                         if (event.keyboard.keycode == ALLEGRO_KEY_ESCAPE) {
                                 done = true;
                         } else if (event.keyboard.keycode == ALLEGRO_KEY_SPACE) {
-                                if (settings.step_at_a_time) {
-                                        simulation_state = simulation_step(&settings, simulation_state);
-                                        step = true;
+                                if (settings->step_at_a_time) {
+                                        request_simulation_step(&simulation_thread);
                                 } else {
-                                        paused = !paused;
+                                        toggle_simulation_pause(&simulation_thread);
                                 }
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_EQUALS ||
+                                   event.keyboard.keycode == ALLEGRO_KEY_PAD_PLUS) {
+                                zoom_grid_view(&renderer.view, true);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_MINUS ||
+                                   event.keyboard.keycode == ALLEGRO_KEY_PAD_MINUS) {
+                                zoom_grid_view(&renderer.view, false);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_LEFT) {
+                                pan_grid_view(&renderer.view, -1, 0);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_RIGHT) {
+                                pan_grid_view(&renderer.view, 1, 0);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_UP) {
+                                pan_grid_view(&renderer.view, 0, -1);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_DOWN) {
+                                pan_grid_view(&renderer.view, 0, 1);
+                        } else if (event.keyboard.keycode == ALLEGRO_KEY_HOME) {
+                                renderer.view.span = renderer.view.dimension;
+                                clamp_grid_view(&renderer.view);
                         }
                         break;
                 case ALLEGRO_EVENT_DISPLAY_CLOSE:
@@ -786,20 +5884,247 @@ int main(int argc, char *argv[]) {
                 }
                 
                 if(redraw && al_is_event_queue_empty(queue)) {
-                        draw_ui(&settings, simulation_state, !paused && (step || !settings.step_at_a_time));
-                        step = false;
+                        uint64_t start = profile_begin();
+                        const struct snapshot *snapshot;
+                        bool step = latest_snapshot(&simulation_thread, &snapshot);
+                        draw_ui(settings, &renderer, snapshot, &simulation_thread, step);
                         al_flip_display();
+                        profile_end(PROFILE_FRAME, start);
                         redraw = false;
                 }
         }
 
-        al_destroy_font(settings.text_font);
+        stop_simulation_thread(&simulation_thread);
+        bool ok = stop_output_sink(&output);
+        stop_checkpoint_writer(&checkpoints, &simulation);
+        destroy_grid_renderer(&renderer);
+        al_destroy_font(settings->text_font);
         al_destroy_display(display);
         al_destroy_timer(draw_timer);
-        if (simulation_timer != NULL) {
-                al_destroy_timer(simulation_timer);
-        }
         al_destroy_event_queue(queue);
+        destroy_simulation(&simulation);
+#ifdef PROFILE
+        stop_profile_ring();
+#endif
         
-        return 0;
+        return ok ? 0 : 1;
+}
+#endif
+
+
+///////////////////////////////
+/////[BENCHMARK FUNCTIONS]/////
+///////////////////////////////
+
+static double elapsed_seconds(const struct timespec *start) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/*
+ * Infect the given share of the grid, at random ages, leaving the rest
+ * healthy.
+ */
+static void seed_bench_grid(struct simulation *simulation, double density) {
+        int dim = simulation->dimension;
+        int max_infected_value = simulation->settings->max_infected_value;
+        struct rng rng = rng_for_step(simulation->settings->rng_seed, 0);
+        uint64_t threshold = chance_threshold(density);
+
+        for (int i=0; i<dim; i++) {
+                for (int j=0; j<dim; j++) {
+                        size_t cell = (size_t)j + (size_t)i * dim;
+                        int state = 0;
+                        if (chance(threshold, rng_draw(&rng, cell, 0))) {
+                                state = 1 + (int)(rng_draw(&rng, cell, 1) % max_infected_value);
+                        }
+                        store_cell(simulation->state, grid_index(dim, i, j), state, simulation->compact);
+                }
+        }
+
+        simulation->step = 0;
+        tally_state(simulation, &simulation->tally);
+        reset_engine(simulation);
+}
+
+static void print_bench(const char *benchmark, enum engine engine, int dim, double density,
+                        double cells, double seconds, long peak_rss) {
+        printf("%s %s %d %g %.0f %.6f %.0f %.3f %ld\n", benchmark, engine_names[engine], dim, density,
+               cells, seconds, cells / seconds, seconds * 1e9 / cells, peak_rss);
+}
+
+/*
+ * Take the measurements for one engine, dimension and density. Each
+ * measurement is repeated until it covers enough cells to be timed.
+ */
+static void bench_configuration(struct settings *settings, enum engine engine, int dim, double density) {
+        struct settings bench_settings = *settings;
+        bench_settings.engine = engine;
+        bench_settings.simulation_grid_dimension = dim;
+        int steps = settings->headless_steps > 0 ? settings->headless_steps : 10;
+        double cells = (double)dim * dim;
+        int repeats = (int)MAX(1, 2e7 / cells);
+
+        struct simulation simulation;
+        create_simulation(&bench_settings, &simulation);
+        seed_bench_grid(&simulation, density);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i<steps; i++) {
+                simulation_step(&bench_settings, &simulation);
+        }
+        double step_seconds = elapsed_seconds(&start);
+
+        struct tally tally;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i<repeats; i++) {
+                tally_state(&simulation, &tally);
+        }
+        double tally_seconds = elapsed_seconds(&start);
+
+#ifndef NO_ALLEGRO
+        // Building every level of detail, as when drawing starts, and
+        // then drawing the whole grid from them
+        sync_grid(&simulation);
+        struct grid_view view;
+        create_grid_view(&bench_settings, dim, &view);
+        struct snapshot snapshot = {
+                .dimension = dim,
+                .compact = simulation.compact,
+                .cells = simulation.state,
+                .tiles = 0,
+                .dirty = NULL,
+                .stale = NULL,
+        };
+        int render_repeats = (int)MAX(1, 2e7 / (DISPLAYY * DISPLAYY));
+        int pitch = DISPLAYY * sizeof(uint32_t);
+        char *pixels = malloc((size_t)pitch * DISPLAYY);
+        must_init(pixels != NULL, "render buffer");
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i<repeats; i++) {
+                view.built = false;
+                update_grid_view(&view, &snapshot);
+        }
+        double levels_seconds = elapsed_seconds(&start);
+
+        int size = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i<render_repeats; i++) {
+                if (simulation.compact) {
+                        size = fill_view_pixels(&view, &snapshot, pixels, pitch, true);
+                } else {
+                        size = fill_view_pixels(&view, &snapshot, pixels, pitch, false);
+                }
+        }
+        double render_seconds = elapsed_seconds(&start);
+        int levels = view.levels;
+
+        free(pixels);
+        destroy_grid_view(&view);
+#endif
+
+        destroy_simulation(&simulation);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        print_bench("step", engine, dim, density, cells * steps, step_seconds, usage.ru_maxrss);
+        print_bench("tally", engine, dim, density, cells * repeats, tally_seconds, usage.ru_maxrss);
+#ifndef NO_ALLEGRO
+        if (levels > 0) {
+                print_bench("levels", engine, dim, density, cells * repeats, levels_seconds, usage.ru_maxrss);
+        }
+        print_bench("render", engine, dim, density, (double)size * size * render_repeats,
+                    render_seconds, usage.ru_maxrss);
+#endif
+}
+
+/*
+ * Benchmark every engine over a range of grid sizes and densities.
+ * Each configuration runs in a process of its own, so that the peak
+ * memory reported is its own and one running out of memory doesn't
+ * take the rest down.
+ */
+static int run_bench(struct settings *settings) {
+        static const int dimensions[] = {100, 300, 1000, 3000, 10000, 20000};
+        static const double densities[] = {0.001, 0.05, 0.5};
+        int status = 0;
+#ifndef NO_ALLEGRO
+        // Drawing is timed with the colours it would be drawn in
+        must_init(al_init(), "allegro");
+        map_colors(settings);
+#endif
+
+        printf("benchmark engine dimension density cells seconds cells_per_second ns_per_cell peak_rss_kb\n");
+        for (size_t d=0; d<sizeof(dimensions)/sizeof(dimensions[0]); d++) {
+                if (dimensions[d] > settings->bench_dimension) {
+                        break;
+                }
+                for (size_t k=0; k<sizeof(densities)/sizeof(densities[0]); k++) {
+                        for (int engine=0; engine<ENGINES; engine++) {
+                                fflush(stdout);
+                                pid_t child = fork();
+                                must_init(child >= 0, "benchmark process");
+                                if (child == 0) {
+                                        bench_configuration(settings, engine, dimensions[d], densities[k]);
+                                        fflush(stdout);
+                                        _exit(0);
+                                }
+
+                                int child_status;
+                                if (waitpid(child, &child_status, 0) < 0 ||
+                                    !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+                                        fprintf(stderr, "benchmark failed: %s engine, dimension %d, density %g\n",
+                                                engine_names[engine], dimensions[d], densities[k]);
+                                        status = 1;
+                                }
+                        }
+                }
+        }
+
+        return status;
+}
+
+
+/////////////////////////
+/////[MAIN FUNCTION]/////
+/////////////////////////
+
+int main(int argc, char *argv[]) {
+        // Read settings from arguments
+        struct settings settings;
+        parse_args(argc, argv, &settings);
+
+        if (settings.sweeping) {
+                return run_sweep(&settings);
+        } else if (settings.runs > 0) {
+                return run_ensemble(&settings);
+        } else if (settings.procs > 1) {
+                return run_processes(&settings);
+        } else if (settings.bench_dimension > 0) {
+                return run_bench(&settings);
+        } else if (settings.network_path != NULL) {
+                return run_network(&settings);
+        }
+
+        struct checkpoint checkpoint;
+        if (settings.resume_path != NULL) {
+                if (!open_checkpoint(settings.resume_path, &checkpoint)) {
+                        return 1;
+                }
+                apply_checkpoint_settings(&checkpoint, &settings);
+        }
+
+#ifndef NO_ALLEGRO
+        int status = settings.headless ? run_headless(&settings) : run_interactive(&settings);
+#else
+        int status = run_headless(&settings);
+#endif
+
+        if (settings.resume_path != NULL) {
+                close_checkpoint(&checkpoint);
+        }
+        return status;
 }